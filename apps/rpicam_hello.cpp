@@ -30,10 +30,11 @@ static void event_loop(RPiCamApp &app)
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			app.RestartCamera();
 			continue;
 		}
+		if (msg.type == RPiCamApp::MsgType::Diagnostic)
+			continue; // the watchdog has logged it already
 		if (msg.type == RPiCamApp::MsgType::Quit)
 			return;
 		else if (msg.type != RPiCamApp::MsgType::RequestComplete)
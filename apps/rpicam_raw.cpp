@@ -45,10 +45,11 @@ static void event_loop(LibcameraRaw &app)
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			app.RestartCamera();
 			continue;
 		}
+		if (msg.type == RPiCamApp::MsgType::Diagnostic)
+			continue; // the watchdog has logged it already
 		if (msg.type != LibcameraRaw::MsgType::RequestComplete)
 			throw std::runtime_error("unrecognised message!");
 		if (count == 0)
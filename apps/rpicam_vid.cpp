@@ -91,10 +91,11 @@ static void event_loop(RPiCamEncoder &app)
 		if (msg.type == RPiCamApp::MsgType::Timeout)
 		{
 			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
+			app.RestartCamera();
 			continue;
 		}
+		if (msg.type == RPiCamApp::MsgType::Diagnostic)
+			continue; // the watchdog has logged it already
 		if (msg.type == RPiCamEncoder::MsgType::Quit)
 			return;
 		else if (msg.type != RPiCamEncoder::MsgType::RequestComplete)
@@ -1,6 +1,8 @@
 
 #include <libcamera/stream.h>
+#include "core/fd_broker.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/shared_context.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 
@@ -17,6 +19,8 @@
 
 // END NEEDED FOR LOGGING
 
+#include <stdexcept>
+
 
 
 #define PROJECT_ID 0x4341494D // ASCII for "CAIM"
@@ -26,21 +30,42 @@
 using Stream = libcamera::Stream;
 
 
+// The buffer is given as its index among those the fd broker listening on socket_path has sent, within
+// the broker generation given. Readers register in the consumer registry, just as for the shared context,
+// with frame counting the updates so far. A segment left by an earlier run is only carried on with (keeping
+// its consumers) if magic and version show that it has the same layout. Bump VERSION whenever that changes.
+//
+// buffer, span_size and generation are guarded by a sequence lock, as the shared context's slots are:
+// seq is odd while they're being written, so a reader must load seq (acquire), copy them, and load seq
+// again after an acquire fence, trying again unless both loads gave the same even value.
 struct SharedStreamData {
+	static constexpr uint32_t MAGIC = 0x4341494D; // "CAIM"
+	static constexpr uint32_t VERSION = 1;
 	SharedStreamData() : procid(-1) {}
+	uint32_t magic;
+	uint32_t version;
 	StreamInfo stream_info;
 	int procid;
-	int fd;
+	std::atomic<uint32_t> seq;
+	int buffer;
 	int span_size;
+	uint32_t generation;
+	char socket_path[108];
+	std::atomic<uint64_t> frame;
+	SharedConsumers consumers;
+	// Readers that are attached keep their registry entries and cursors.
 	void resetStreamData() {
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
 		procid = getpid();
-		fd=-1;
+		buffer=-1;
 		stream_info.width = 0;
 		stream_info.height = 0;
 		stream_info.stride = 0;
 		stream_info.pixel_format = {};
 		stream_info.colour_space.reset();
 		span_size = -1;
+		seq.store(seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
 	}
 };
 
@@ -52,7 +77,10 @@ public:
 	shareStreamInfo(RPiCamApp *app) ;
 	virtual ~shareStreamInfo() override;
 	char const *Name() const override;
-	void Read(boost::property_tree::ptree const &params) override {}
+	void Read(boost::property_tree::ptree const &params) override
+	{
+		socket_path_ = params.get<std::string>("socket", "/tmp/cinepi-stream.sock");
+	}
 	void Configure() override;
 	bool Process(CompletedRequestPtr &completed_request) override;
 
@@ -62,6 +90,9 @@ private:
 	SharedStreamData* shared_data;
 	int segment_id;
 	key_t segment_key;
+	std::string socket_path_;
+	std::unique_ptr<FdBroker> broker_;
+	uint64_t buffer_generation_ = 0;
 };
 
 
@@ -70,36 +101,69 @@ char const *shareStreamInfo::Name() const
 	return NAME;
 }
 
-shareStreamInfo::shareStreamInfo(RPiCamApp *app) :PostProcessingStage(app) {
+shareStreamInfo::shareStreamInfo(RPiCamApp *app) :PostProcessingStage(app), shared_data(nullptr) {
 
 }
 
 void shareStreamInfo::Configure()
 {
-	
-	console = spdlog::stdout_color_mt("share_stream_info");
-	console->info("share_stream_info is running (PID: {})", getpid()); // <-- 
-	fprintf(stderr, "share_stream_info Configure() reached (PID: %d)\n", getpid());
-	fflush(stderr);
-	// Generate a unique key for the shared memory segment
-    segment_key = ftok("/tmp", PROJECT_ID);
-    console->info("sharedContextStage: ftok returned key 0x{:08X}", segment_key);
-	segment_id = shmget(segment_key, sizeof(SharedStreamData), IPC_CREAT | S_IRUSR | S_IWUSR);
-    console->info("sharedContextStage: sending Buffer of size {}", sizeof(SharedStreamData)	);
-	if (segment_id == -1) {
-        console->error("shmget failed with key \"0x{:08X}\", SharedStreamData size: {}  Error: \"{}\"",
-            segment_key, sizeof(SharedStreamData), strerror(errno));
-    }
-	// Attach the shared memory segment
-    shared_data = (SharedStreamData*)shmat(segment_id, NULL, 0); 
-	// ADD ERROR HANDLING
-	if (shared_data == (SharedStreamData*)-1) {
-		console->error("Attaching the shared memory segment failed with key \"0x{:08X}\", Error: \"{}\"",
-			segment_key, strerror(errno));
+	// Only set up the segment the first time we're configured.
+	if (!shared_data) {
+		console = spdlog::stdout_color_mt("share_stream_info");
+		console->info("share_stream_info is running (PID: {})", getpid()); // <-- 
+		// Generate a unique key for the shared memory segment
+		segment_key = ftok("/tmp", PROJECT_ID);
+		console->info("sharedContextStage: ftok returned key 0x{:08X}", segment_key);
+		segment_id = shmget(segment_key, sizeof(SharedStreamData), IPC_CREAT | S_IRUSR | S_IWUSR);
+		if (segment_id == -1 && errno == EINVAL)
+		{
+			// One left behind with an older, smaller layout can't be re-used, so replace it.
+			int old_id = shmget(segment_key, 0, 0);
+			if (old_id != -1)
+				shmctl(old_id, IPC_RMID, NULL);
+			segment_id = shmget(segment_key, sizeof(SharedStreamData), IPC_CREAT | S_IRUSR | S_IWUSR);
+		}
+		console->info("sharedContextStage: sending Buffer of size {}", sizeof(SharedStreamData)	);
+		if (segment_id == -1)
+			throw std::runtime_error("share_stream_info: failed to get shared memory segment: " +
+									 std::string(strerror(errno)));
+		// Attach the shared memory segment
+		void *segment = shmat(segment_id, NULL, 0);
+		if (segment == (void *)-1)
+			throw std::runtime_error("share_stream_info: failed to attach shared memory segment: " +
+									 std::string(strerror(errno)));
+		shared_data = (SharedStreamData *)segment;
+
+		// Readers may still be attached from a previous run with the same layout. Anything else in the
+		// segment means nothing, so start the registry and the counts afresh.
+		if (shared_data->magic == SharedStreamData::MAGIC && shared_data->version == SharedStreamData::VERSION)
+			shared_data->consumers.Reap();
+		else
+		{
+			shared_data->magic = 0;
+			shared_data->seq.store(0, std::memory_order_relaxed);
+			shared_data->generation = 0;
+			shared_data->frame.store(0, std::memory_order_relaxed);
+			shared_data->consumers.Clear();
+			shared_data->version = SharedStreamData::VERSION;
+			std::atomic_thread_fence(std::memory_order_release);
+			shared_data->magic = SharedStreamData::MAGIC;
+		}
 	}
 	shared_data->resetStreamData();
 	stream_ = app_->GetMainStream();
 	shared_data->stream_info = app_->GetStreamInfo(stream_);
+	// The buffer is only shared by fd, so leave mapping and cache maintenance to any stage that reads it.
+	app_->SetBufferSyncPolicy(stream_, RPiCamApp::BufferSyncPolicy::Lazy);
+	app_->SetBufferMapPolicy(stream_, RPiCamApp::BufferMapPolicy::Lazy);
+
+	// Consumers from before a restart must see a new generation.
+	if (!broker_)
+		broker_ = std::make_unique<FdBroker>(socket_path_, shared_data->generation + 1);
+	else
+		broker_->Reset();
+	buffer_generation_ = app_->BufferGeneration();
+	snprintf(shared_data->socket_path, sizeof(shared_data->socket_path), "%s", socket_path_.c_str());
 
 
 
@@ -109,12 +173,30 @@ bool shareStreamInfo::Process(CompletedRequestPtr &completed_request)
 {
 	// console->info("updating buffer....."); // <-- 
 	shared_data->procid = getpid();
-	shared_data->fd = completed_request->buffers[app_->GetMainStream()]->planes()[0].fd.get();
+	if (app_->BufferGeneration() != buffer_generation_)
+	{
+		buffer_generation_ = app_->BufferGeneration();
+		broker_->Reset();
+	}
+	// Consumers map each buffer once, when the broker sends it, and only need its index from here on.
+	int buffer = broker_->Index(completed_request->buffers[stream_], 0);
 
 	// BufferWriteSync w(app_, completed_request->buffers[stream_]);
 	// libcamera::Span<uint8_t> span = w.Get()[0].size();                  ALTERNATIVE WAY TO GET SPAN SIZE
 
+	uint32_t seq = shared_data->seq.load(std::memory_order_relaxed);
+	shared_data->seq.store(seq + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+	shared_data->generation = broker_->Generation();
+	shared_data->buffer = buffer;
 	shared_data->span_size = completed_request->buffers[stream_]->planes()[0].length;
+	shared_data->seq.store(seq + 2, std::memory_order_release);
+
+	uint64_t frame = shared_data->frame.fetch_add(1, std::memory_order_release) + 1;
+	shared_data->consumers.Update(frame);
+	if (frame % 256 == 0)
+		shared_data->consumers.Reap();
+	broker_->Notify();
 
 
 	return false;
@@ -122,8 +204,9 @@ bool shareStreamInfo::Process(CompletedRequestPtr &completed_request)
 
 shareStreamInfo::~shareStreamInfo()
 {
-	shmdt(shared_data);
-    shmctl(segment_id, IPC_RMID, NULL);
+	// Leave the segment for any readers still attached, and for the next run to carry on with.
+	if (shared_data)
+		shmdt(shared_data);
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
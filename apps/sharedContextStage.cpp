@@ -6,8 +6,11 @@
 
 #include <libcamera/stream.h>
 
+#include "core/fd_broker.hpp"
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
+#include "core/shared_context.hpp"
+#include "core/thread_policy.hpp"
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include <spdlog/spdlog.h>
@@ -20,41 +23,13 @@
 #include <sys/ipc.h>
 #include <sys/shm.h>
 
-#define PROJECT_ID 0x43494E45 // ASCII for "CINE"
-
-struct SharedMetadata {
-	float exposure_time;
-	float analogue_gain;
-	float digital_gain;
-    unsigned int colorTemp;
-    int64_t ts;
-    float colour_gains[2];
-	float focus;
-	float fps;
-	// bool aelock;
-	float lens_position;
-	int af_state;
-};
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <deque>
+#include <stdexcept>
 
-struct SharedMemoryBuffer {
-    SharedMemoryBuffer() : fd_raw(-1), fd_isp(-1), fd_lores(-1), procid(-1), frame(static_cast<uint64_t>(-1)) {}
-    int fd_raw;
-    int fd_isp;
-    int fd_lores;
-    StreamInfo raw;
-    StreamInfo isp;
-    StreamInfo lores;
-    size_t raw_length;
-    size_t isp_length;
-    size_t lores_length;
-    int procid;
-    uint64_t frame;
-    uint64_t ts;
-    SharedMetadata metadata;
-    unsigned int sequence;
-    float framerate;
-    uint8_t stats[23200];
-};
+#define PROJECT_ID 0x43494E45 // ASCII for "CINE"
 
 uint64_t getTs(){
     struct timespec ts;
@@ -74,16 +49,41 @@ public:
     void Read(boost::property_tree::ptree const &params) override;
     void Configure() override;
     bool Process(CompletedRequestPtr &completed_request) override;
+    void ReleaseRequests() override;
     void Teardown() override;
 
 
 private:
     std::shared_ptr<spdlog::logger> console;
 
-    void parseMetaData(libcamera::ControlList &ctrls);
+    void parseMetaData(libcamera::ControlList &ctrls, SharedMetadata &metadata);
 
     int segment_id;
-    SharedMemoryBuffer* shared_data;
+    SharedContext* shared_data;
+    std::string socket_path_;
+    std::unique_ptr<FdBroker> broker_;
+    uint32_t first_generation_ = 0;
+    uint64_t buffer_generation_ = 0;
+
+    // Frames lent to the reader, oldest first. Holding the request keeps its buffers from the camera.
+    struct Lease
+    {
+        uint64_t index;
+        CompletedRequestPtr request;
+        std::chrono::steady_clock::time_point expiry;
+    };
+    void releaseLeases(uint64_t released, std::deque<Lease> &done);
+    void leaseThread();
+    // How often (in frames) to look for consumers that exited without detaching.
+    static constexpr unsigned int REAP_INTERVAL = 256;
+    unsigned int max_leases_ = 0;
+    unsigned int lease_limit_ = 0; // max_leases_, capped for the current configuration
+    std::chrono::milliseconds lease_timeout_;
+    std::mutex leases_mutex_;
+    std::condition_variable leases_cv_;
+    std::deque<Lease> leases_;
+    bool lease_quit_ = false;
+    std::thread lease_thread_;
     key_t segment_key;
 
     bool running_ = true;
@@ -98,7 +98,10 @@ char const *sharedContextStage::Name() const
 
 void sharedContextStage::Read(boost::property_tree::ptree const &params)
 {
-
+    socket_path_ = params.get<std::string>("socket", "/tmp/cinepi-context.sock");
+    // Every frame on loan is a request the camera can't use, so keep this well below the buffer count.
+    max_leases_ = params.get<unsigned int>("max_leases", 0);
+    lease_timeout_ = std::chrono::milliseconds(params.get<unsigned int>("lease_timeout_ms", 200));
 }
 
 sharedContextStage::sharedContextStage(RPiCamApp *app) : PostProcessingStage(app), shared_data(nullptr) 
@@ -108,48 +111,81 @@ sharedContextStage::sharedContextStage(RPiCamApp *app) : PostProcessingStage(app
     console = spdlog::stdout_color_mt("sharedContextStage");
     console->info("sharedContextStage is running (PID: {})", getpid()); // <-- Added log
 
-    const int size = sizeof(SharedMemoryBuffer);
+    const int size = sizeof(SharedContext);
     
     // Generate a unique key for the shared memory segment
     segment_key = ftok("/tmp", PROJECT_ID);
     console->info("sharedContextStage: ftok returned key 0x{:08X}", segment_key);
-    // Try to obtain an existing segment or create a new one
+    // Try to obtain an existing segment or create a new one. One left behind with an older, smaller
+    // layout can't be re-used, so replace it.
     segment_id = shmget(segment_key, size, IPC_CREAT | S_IRUSR | S_IWUSR);
-    if (segment_id == -1) {
-        // Handle error
+    if (segment_id == -1 && errno == EINVAL)
+    {
+        int old_id = shmget(segment_key, 0, 0);
+        if (old_id != -1)
+            shmctl(old_id, IPC_RMID, NULL);
+        segment_id = shmget(segment_key, size, IPC_CREAT | S_IRUSR | S_IWUSR);
     }
+    if (segment_id == -1)
+        throw std::runtime_error("sharedContextStage: failed to get shared memory segment: " +
+                                 std::string(strerror(errno)));
 
     // Attach the shared memory segment
-    shared_data = (SharedMemoryBuffer*)shmat(segment_id, NULL, 0);
-    if (shared_data == (void*) -1) {
-        // Handle error
+    shared_data = (SharedContext*)shmat(segment_id, NULL, 0);
+    if (shared_data == (void*) -1)
+        throw std::runtime_error("sharedContextStage: failed to attach shared memory segment: " +
+                                 std::string(strerror(errno)));
+
+    // Readers may still be attached from a previous run. If the layout is the same, leave them and their
+    // cursors alone and carry on numbering frames (and broker generations) from where it left off, but empty
+    // the ring slot by slot rather than pulling it out from under them.
+    if (shared_data->magic == SharedContext::MAGIC && shared_data->version == SharedContext::VERSION)
+    {
+        first_generation_ = shared_data->broker_generation.load(std::memory_order_relaxed) + 1;
+        shared_data->consumers.Reap();
     }
-
-    if(shared_data->frame == static_cast<uint64_t>(-1)){
-        shared_data->frame = 0;
-        shared_data->procid = getpid();
-        shared_data->ts = getTs();
-    }else{
-        shared_data->fd_raw = -1;
-        shared_data->fd_isp = -1;
-        shared_data->fd_lores = -1;
-        shared_data->frame = 0;
-        shared_data->procid = getpid();
-        shared_data->ts = getTs();
+    else
+    {
+        shared_data->magic = 0;
+        shared_data->write_index.store(0, std::memory_order_relaxed);
+        shared_data->broker_generation.store(0, std::memory_order_relaxed);
+        shared_data->consumers.Clear();
     }
-
-    
+    shared_data->leases_expired.store(0, std::memory_order_relaxed);
+    shared_data->max_leases = 0;
+    for (SharedSlot &slot : shared_data->slots)
+    {
+        slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_release);
+        slot.frame.index = static_cast<uint64_t>(-1);
+        slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+    }
+    shared_data->num_slots = SharedContext::NUM_SLOTS;
+    shared_data->procid = getpid();
+    shared_data->ts = getTs();
+    shared_data->version = SharedContext::VERSION;
+    std::atomic_thread_fence(std::memory_order_release);
+    shared_data->magic = SharedContext::MAGIC;
 }
 
 sharedContextStage::~sharedContextStage() 
 {
+    if (lease_thread_.joinable())
+    {
+        {
+            std::lock_guard<std::mutex> lock(leases_mutex_);
+            lease_quit_ = true;
+        }
+        leases_cv_.notify_one();
+        lease_thread_.join();
+    }
+    // The segment outlives us, so that readers stay attached to it (with their registry entries and cursors)
+    // until the next run carries on where this one left off.
     shmdt(shared_data);
-    shmctl(segment_id, IPC_RMID, NULL);
 }
 
 void sharedContextStage::Teardown(){
-    shmdt(shared_data);
-    shmctl(segment_id, IPC_RMID, NULL);
+    // We may be configured again, so keep the segment attached until we're destroyed.
 }
 
 
@@ -158,81 +194,210 @@ void sharedContextStage::Configure()
     shared_data->raw = app_->GetStreamInfo(app_->RawStream());
     shared_data->isp = app_->GetStreamInfo(app_->GetMainStream());
     // shared_data->lores = app_->GetStreamInfo(app_->LoresStream());
+
+    // Consumers get the buffers themselves from the broker, once each, as we first come across them.
+    if (!broker_)
+    {
+        broker_ = std::make_unique<FdBroker>(socket_path_, first_generation_);
+        snprintf(shared_data->socket_path, sizeof(shared_data->socket_path), "%s", socket_path_.c_str());
+    }
+    else
+        broker_->Reset();
+    buffer_generation_ = app_->BufferGeneration();
+    shared_data->broker_generation.store(broker_->Generation(), std::memory_order_release);
+    // The camera must always keep some requests of its own, however many the readers would like.
+    unsigned int min_requests = app_->MinRequests();
+    lease_limit_ = std::min(max_leases_, min_requests > 2 ? min_requests - 2 : 0);
+    if (lease_limit_ < max_leases_)
+        console->warn("sharedContextStage: only {} of {} leases possible with {} requests", lease_limit_,
+                      max_leases_, min_requests);
+    shared_data->max_leases = lease_limit_;
+    shared_data->lease_timeout_ms = lease_timeout_.count();
+
+    // Leases must time out even when no frames arrive to notice, for instance if they're all on loan.
+    if (lease_limit_ && !lease_thread_.joinable())
+        lease_thread_ = std::thread(&sharedContextStage::leaseThread, this);
+
+    // Both buffers are only handed on by fd, so don't pay for mappings or cache maintenance unless
+    // another stage needs them. Nothing in this process should ever read the raw buffer.
+    if (app_->RawStream())
+    {
+        app_->SetBufferSyncPolicy(app_->RawStream(), RPiCamApp::BufferSyncPolicy::DeviceOnly);
+        app_->SetBufferMapPolicy(app_->RawStream(), RPiCamApp::BufferMapPolicy::Lazy);
+    }
+    app_->SetBufferSyncPolicy(app_->GetMainStream(), RPiCamApp::BufferSyncPolicy::Lazy);
+    app_->SetBufferMapPolicy(app_->GetMainStream(), RPiCamApp::BufferMapPolicy::Lazy);
 }
 
-#include <chrono>
+void sharedContextStage::ReleaseRequests()
+{
+    // The camera has stopped, so the readers can't keep these any longer. The requests are only dropped once
+    // our own lock is gone too.
+    std::deque<Lease> leases;
+    {
+        std::lock_guard<std::mutex> lock(leases_mutex_);
+        leases.swap(leases_);
+    }
+}
+
+void sharedContextStage::leaseThread()
+{
+    ThreadPolicy::Apply("lease");
+
+    std::unique_lock<std::mutex> lock(leases_mutex_);
+    while (!lease_quit_)
+    {
+        if (leases_.empty())
+            leases_cv_.wait(lock);
+        else
+            leases_cv_.wait_until(lock, leases_.front().expiry);
+
+        // Dropping the requests gives them back to the camera, which shouldn't happen under our lock.
+        std::deque<Lease> done;
+        releaseLeases(shared_data->consumers.Update(shared_data->write_index.load(std::memory_order_acquire)), done);
+        lock.unlock();
+        done.clear();
+        lock.lock();
+    }
+}
+
+void sharedContextStage::releaseLeases(uint64_t released, std::deque<Lease> &done)
+{
+    // Call with leases_mutex_ held. Frames before released are finished with by every consumer, and leases
+    // that are over move to done.
+    auto now = std::chrono::steady_clock::now();
+    bool expired = false;
+
+    while (!leases_.empty() && (leases_.front().index < released || leases_.size() > lease_limit_ ||
+                                leases_.front().expiry <= now))
+    {
+        if (leases_.front().index >= released)
+        {
+            shared_data->leases_expired.fetch_add(1, std::memory_order_relaxed);
+            expired = true;
+        }
+        done.push_back(std::move(leases_.front()));
+        leases_.pop_front();
+    }
+
+    // Perhaps whoever was holding on to it has gone away without detaching.
+    if (expired)
+    {
+        unsigned int reaped = shared_data->consumers.Reap();
+        if (reaped)
+            console->info("sharedContextStage: removed {} consumers that have exited", reaped);
+    }
+}
 
 bool sharedContextStage::Process(CompletedRequestPtr &completed_request)
 {
-    shared_data->ts = getTs();
+    // A buffer we've already handed out may have been freed, and a new one could turn up at the same address.
+    if (app_->BufferGeneration() != buffer_generation_)
+    {
+        buffer_generation_ = app_->BufferGeneration();
+        broker_->Reset();
+        shared_data->broker_generation.store(broker_->Generation(), std::memory_order_release);
+    }
 
+    // Never wait for readers here: a slow one just finds that it has missed some frames.
+    SharedFrame &frame = shared_data->Begin();
+    frame.ts = getTs();
+
+    frame.stats_length = 0;
     auto stats = completed_request->metadata.get(libcamera::controls::rpi::PispStatsOutput);
     if(stats.has_value()){
         libcamera::Span<const uint8_t> statsSpan = stats.value();
-        std::memcpy(shared_data->stats, statsSpan.data(), statsSpan.size());
+        frame.stats_length = std::min(statsSpan.size(), sizeof(frame.stats));
+        std::memcpy(frame.stats, statsSpan.data(), frame.stats_length);
     };
 
     {
-        shared_data->fd_raw = completed_request->buffers[app_->RawStream()]->planes()[0].fd.get();
-        shared_data->fd_isp = completed_request->buffers[app_->GetMainStream()]->planes()[0].fd.get();
-        shared_data->raw_length = completed_request->buffers[app_->RawStream()]->planes()[0].length;
-        shared_data->isp_length = completed_request->buffers[app_->GetMainStream()]->planes()[0].length;
-        // shared_data->fd_lores = completed_request->buffers[app_->LoresStream()]->planes()[0].fd.get();
-        // shared_data->fdSize[shared_data->active_buffer] = completed_request->buffers[stream_]->planes()[0].length;
-        shared_data->framerate = completed_request->framerate;
-        shared_data->sequence = completed_request->sequence;
-        parseMetaData(completed_request->metadata);
+        // Not every stream need be there (e.g. with no raw stream), and looking one up mustn't add it.
+        auto find_buffer = [&completed_request](Stream const *stream) -> libcamera::FrameBuffer *
+        {
+            auto it = completed_request->buffers.find(stream);
+            return it == completed_request->buffers.end() ? nullptr : it->second;
+        };
+        libcamera::FrameBuffer *raw = find_buffer(app_->RawStream());
+        libcamera::FrameBuffer *isp = find_buffer(app_->GetMainStream());
+
+        frame.generation = broker_->Generation();
+        frame.raw_buffer = broker_->Index(raw, SharedContext::RawStream);
+        frame.isp_buffer = broker_->Index(isp, SharedContext::IspStream);
+        frame.lores_buffer = -1;
+        frame.raw_length = raw ? raw->planes()[0].length : 0;
+        frame.isp_length = isp ? isp->planes()[0].length : 0;
+        frame.lores_length = 0;
+        // frame.lores_buffer = broker_->Index(find_buffer(app_->LoresStream()), SharedContext::LoresStream);
+        frame.framerate = completed_request->framerate;
+        frame.sequence = completed_request->sequence;
+        parseMetaData(completed_request->metadata, frame.metadata);
     }
 
-    shared_data->frame++;
+    uint64_t index = frame.index;
+    shared_data->Publish();
+    broker_->Notify();
+
+    // With no consumer using buffers, everything counts as released and nothing stays on loan.
+    uint64_t released = shared_data->consumers.Update(index + 1);
+    if (lease_limit_)
+    {
+        std::deque<Lease> done;
+        std::lock_guard<std::mutex> lock(leases_mutex_);
+        leases_.push_back({ index, completed_request, std::chrono::steady_clock::now() + lease_timeout_ });
+        releaseLeases(released, done);
+        if (leases_.size() == 1)
+            leases_cv_.notify_one();
+    }
+    if (index % REAP_INTERVAL == 0)
+        shared_data->consumers.Reap();
 
     return false;
 }
 
-void sharedContextStage::parseMetaData(libcamera::ControlList &ctrls)
+void sharedContextStage::parseMetaData(libcamera::ControlList &ctrls, SharedMetadata &metadata)
 {
+    // Slots are re-used, so anything this frame doesn't report must not be left over from an older one.
+    metadata = {};
+
     auto colorT = ctrls.get(libcamera::controls::ColourTemperature);
     if (colorT)
-        shared_data->metadata.colorTemp = *colorT;
+        metadata.colorTemp = *colorT;
 
     auto sts = ctrls.get(libcamera::controls::SensorTimestamp);
     if(sts){
-        shared_data->metadata.ts = (*sts);
+        metadata.ts = (*sts);
     }
 
     auto exp = ctrls.get(libcamera::controls::ExposureTime);
     if (exp)
-        shared_data->metadata.exposure_time = *exp;
+        metadata.exposure_time = *exp;
 
     auto ag = ctrls.get(libcamera::controls::AnalogueGain);
     if (ag)
-        shared_data->metadata.analogue_gain = *ag;
+        metadata.analogue_gain = *ag;
 
     auto dg = ctrls.get(libcamera::controls::DigitalGain);
     if (dg)
-        shared_data->metadata.digital_gain = *dg;
+        metadata.digital_gain = *dg;
 
     auto cg = ctrls.get(libcamera::controls::ColourGains);
     if (cg)
     {
-        shared_data->metadata.colour_gains[0] = (*cg)[0], shared_data->metadata.colour_gains[1] = (*cg)[1];
+        metadata.colour_gains[0] = (*cg)[0], metadata.colour_gains[1] = (*cg)[1];
     }
 
     auto fom = ctrls.get(libcamera::controls::FocusFoM);
     if (fom)
-        shared_data->metadata.focus = *fom;
-
-    // auto ae = ctrls.get(libcamera::controls::AeLocked);
-    // if (ae)
-    //     shared_data->metadata.aelock = *ae;
+        metadata.focus = *fom;
 
     auto lp = ctrls.get(libcamera::controls::LensPosition);
     if (lp)
-        shared_data->metadata.lens_position = *lp;
+        metadata.lens_position = *lp;
 
     auto afs = ctrls.get(libcamera::controls::AfState);
     if (afs)
-        shared_data->metadata.af_state = *afs;
+        metadata.af_state = *afs;
 }
 
 static PostProcessingStage *Create(RPiCamApp *app)
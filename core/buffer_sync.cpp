@@ -19,25 +19,31 @@ BufferWriteSync::BufferWriteSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 	struct dma_buf_sync dma_sync {};
 	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_RW;
 
-	auto it = app->mapped_buffers_.find(fb_);
-	if (it == app->mapped_buffers_.end())
+	RPiCamApp::MappedBuffer *mapped = app->mapBuffer(fb_);
+	if (!mapped)
 	{
 		LOG_ERROR("failed to find buffer in BufferWriteSync");
 		return;
 	}
 
-	int ret = ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+	RPiCamApp::BufferSyncState *sync = app->syncState(fb_);
+	syncable_ = !sync || sync->syncable;
+
+	int ret = syncable_ ? ::ioctl(fb_->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync) : 0;
 	if (ret)
 	{
 		LOG_ERROR("failed to lock-sync-write dma buf");
 		return;
 	}
 
-	planes_ = it->second;
+	planes_ = mapped->planes;
 }
 
 BufferWriteSync::~BufferWriteSync()
 {
+	if (!syncable_)
+		return;
+
 	struct dma_buf_sync dma_sync {};
 	dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_RW;
 
@@ -53,22 +59,47 @@ const std::vector<libcamera::Span<uint8_t>> &BufferWriteSync::Get() const
 
 BufferReadSync::BufferReadSync(RPiCamApp *app, libcamera::FrameBuffer *fb)
 {
-	auto it = app->mapped_buffers_.find(fb);
-	if (it == app->mapped_buffers_.end())
+	RPiCamApp::MappedBuffer *mapped = app->mapBuffer(fb);
+	if (!mapped)
 	{
 		LOG_ERROR("failed to find buffer in BufferReadSync");
 		return;
 	}
 
-	// DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ happens when the request completes,
-	// so nothing to do here but cache the planes map.
-	planes_ = it->second;
+	// For CpuRead streams DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ happened when the request completed.
+	// Otherwise the first reader of the frame does it, and any others wait for that to finish.
+	RPiCamApp::BufferSyncState *sync = app->syncState(fb);
+	if (sync && sync->syncable && sync->policy != RPiCamApp::BufferSyncPolicy::CpuRead)
+	{
+		RPiCamApp::BufferSyncState &state = *sync;
+
+		if (state.policy == RPiCamApp::BufferSyncPolicy::DeviceOnly && !state.warned.exchange(true))
+			LOG_ERROR("BufferReadSync used on a device-only stream");
+
+		int expected = RPiCamApp::BufferSyncState::Idle;
+		if (state.state.compare_exchange_strong(expected, RPiCamApp::BufferSyncState::Syncing,
+												std::memory_order_acquire))
+		{
+			struct dma_buf_sync dma_sync {};
+			dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+			if (::ioctl(fb->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+				LOG_ERROR("failed to lock-sync-read dma buf");
+			state.state.store(RPiCamApp::BufferSyncState::Synced, std::memory_order_release);
+		}
+		else
+		{
+			while (state.state.load(std::memory_order_acquire) == RPiCamApp::BufferSyncState::Syncing)
+				std::this_thread::yield();
+		}
+	}
+
+	planes_ = mapped->planes;
 }
 
 BufferReadSync::~BufferReadSync()
 {
 	// DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ happens when we resend the buffer
-	// in the next request, so nothing to do here.
+	// in the next request, if the buffer was synced, so nothing to do here.
 }
 
 const std::vector<libcamera::Span<uint8_t>> &BufferReadSync::Get() const
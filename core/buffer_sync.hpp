@@ -21,6 +21,7 @@ public:
 
 private:
 	libcamera::FrameBuffer *fb_;
+	bool syncable_ = true;
 	std::vector<libcamera::Span<uint8_t>> planes_;
 };
 
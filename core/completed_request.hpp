@@ -8,6 +8,7 @@
 #pragma once
 
 #include <memory>
+#include <vector>
 
 #include <libcamera/controls.h>
 #include <libcamera/request.h>
@@ -20,17 +21,56 @@ struct CompletedRequest
 	using ControlList = libcamera::ControlList;
 	using Request = libcamera::Request;
 
+	CompletedRequest() : sequence(0), request(nullptr), framerate(0), camera(0) {}
 	CompletedRequest(unsigned int seq, Request *r)
-		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r)
+		: sequence(seq), buffers(r->buffers()), metadata(r->metadata()), request(r), framerate(0), camera(0)
 	{
 		r->reuse();
 	}
+
+	// Refill a CompletedRequest that is being recycled for another frame. The buffer map and metadata
+	// are updated in place so that their existing storage is re-used.
+	void Reset(unsigned int seq, Request *r)
+	{
+		Reset(seq, r->buffers(), r->metadata());
+		request = r;
+		r->reuse();
+	}
+
+	// As above, for frames that didn't come from a Request, such as those from a FrameSource.
+	void Reset(unsigned int seq, BufferMap const &b, ControlList const &src)
+	{
+		sequence = seq;
+		buffers = b;
+		request = nullptr;
+		framerate = 0;
+		paired.clear();
+		post_process_metadata.Clear();
+
+		// Assigning each control in turn lets a ControlValue keep its storage when the size hasn't changed,
+		// which matters for large controls such as the sensor statistics. Copy the whole list only if the
+		// set of controls is different from last time.
+		bool same_controls = src.size() == metadata.size();
+		for (auto it = src.begin(); same_controls && it != src.end(); ++it)
+			same_controls = metadata.contains(it->first);
+		if (same_controls)
+		{
+			for (auto const &[id, value] : src)
+				metadata.set(id, value);
+		}
+		else
+			metadata = src;
+	}
+
 	unsigned int sequence;
 	BufferMap buffers;
 	ControlList metadata;
 	Request *request;
 	float framerate;
 	Metadata post_process_metadata;
+	unsigned int camera; // 0 for the main camera, otherwise 1 + the index into --extra-cameras
+	// Frames from the other cameras that were captured at the same time as this one.
+	std::vector<std::shared_ptr<CompletedRequest>> paired;
 };
 
 using CompletedRequestPtr = std::shared_ptr<CompletedRequest>;
@@ -0,0 +1,134 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * control_scheduler.cpp - Apply controls on a chosen frame.
+ */
+
+#include <algorithm>
+#include <cmath>
+
+#include "core/control_scheduler.hpp"
+#include "core/logging.hpp"
+
+using libcamera::ControlList;
+using libcamera::ControlValue;
+
+void ControlScheduler::Schedule(ControlList const &controls, unsigned int sequence)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (auto const &[id, value] : controls)
+		pending_[id].insert_or_assign(sequence, value);
+}
+
+void ControlScheduler::Collect(ControlList &controls, unsigned int sequence, uint64_t cookie)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (auto it = pending_.begin(); it != pending_.end();)
+	{
+		auto &[id, targets] = *it;
+		auto delay = delays_.find(id);
+		auto due = targets.upper_bound(sequence + (delay == delays_.end() ? 0 : delay->second));
+		if (due != targets.begin())
+		{
+			// Only the last of the values that are due matters.
+			controls.set(id, std::prev(due)->second);
+			targets.erase(targets.begin(), due);
+		}
+		it = targets.empty() ? pending_.erase(it) : std::next(it);
+	}
+
+	for (auto const &[id, value] : controls)
+	{
+		in_flight_.push_back({ id, value, cookie, std::nullopt });
+		reported_.try_emplace(id);
+	}
+}
+
+void ControlScheduler::Completed(uint64_t cookie, unsigned int sequence, ControlList const &metadata,
+								 ControlList &applied)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (InFlight &c : in_flight_)
+	{
+		if (!c.sequence && c.cookie == cookie)
+			c.sequence = sequence;
+	}
+
+	for (auto it = in_flight_.begin(); it != in_flight_.end();)
+	{
+		if (!it->sequence || *it->sequence > sequence)
+		{
+			++it;
+			continue;
+		}
+
+		// Controls that are never reported back are taken to apply to their own request's frame.
+		if (!metadata.contains(it->id))
+			applied.set(it->id, it->value);
+		else if (matches(metadata.get(it->id), it->value))
+		{
+			applied.set(it->id, it->value);
+			// A value the camera was already reporting (such as the current exposure sent again) says nothing
+			// about how long a change takes.
+			auto previous = reported_.find(it->id);
+			if (reported_sequence_ + 1 == sequence && previous != reported_.end() &&
+				!previous->second.isNone() && !matches(previous->second, it->value))
+				delays_[it->id] = sequence - *it->sequence;
+		}
+		else if (sequence - *it->sequence < MAX_DELAY)
+		{
+			++it;
+			continue;
+		}
+		else
+			LOG(2, "Control " << it->id << " from frame " << *it->sequence << " never took effect");
+
+		it = in_flight_.erase(it);
+	}
+
+	for (auto &[id, value] : reported_)
+		value = metadata.contains(id) ? metadata.get(id) : ControlValue();
+	reported_sequence_ = sequence;
+}
+
+void ControlScheduler::ClearInFlight()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	in_flight_.clear();
+}
+
+unsigned int ControlScheduler::Delay(unsigned int id) const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	auto it = delays_.find(id);
+	return it == delays_.end() ? 0 : it->second;
+}
+
+bool ControlScheduler::matches(ControlValue const &actual, ControlValue const &requested)
+{
+	if (actual.type() != requested.type() || actual.isArray() != requested.isArray())
+		return false;
+
+	// The sensor rounds exposures and gains to what it can do, so allow a little slack.
+	double a, r;
+	switch (requested.isArray() ? libcamera::ControlTypeNone : requested.type())
+	{
+	case libcamera::ControlTypeInteger32:
+		a = actual.get<int32_t>(), r = requested.get<int32_t>();
+		break;
+	case libcamera::ControlTypeInteger64:
+		a = actual.get<int64_t>(), r = requested.get<int64_t>();
+		break;
+	case libcamera::ControlTypeFloat:
+		a = actual.get<float>(), r = requested.get<float>();
+		break;
+	default:
+		return actual == requested;
+	}
+
+	return std::abs(a - r) <= std::max(0.02 * std::abs(r), 0.01);
+}
@@ -0,0 +1,64 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * control_scheduler.hpp - Apply controls on a chosen frame.
+ */
+
+#pragma once
+
+#include <map>
+#include <mutex>
+#include <optional>
+#include <vector>
+
+#include <libcamera/controls.h>
+
+// Holds controls that are meant to take effect on a particular frame, and puts each one into the request that
+// should make that happen. Controls typically show up in the metadata a few frames after the request they were
+// in, and how many frames is learnt for each control by watching for the metadata to change to the new value.
+// Frames are counted by CompletedRequest sequence number.
+
+class ControlScheduler
+{
+public:
+	// Controls for the same frame replace each other, and an earlier value that is still waiting when a later
+	// one becomes due is never sent at all.
+	void Schedule(libcamera::ControlList const &controls, unsigned int sequence);
+
+	// Add whatever is now due to the controls of a request that is expected to complete as the given frame,
+	// and start watching for everything in the request to take effect.
+	void Collect(libcamera::ControlList &controls, unsigned int sequence, uint64_t cookie);
+
+	// Called with each completed request. Adds the controls that took effect on this frame to applied.
+	void Completed(uint64_t cookie, unsigned int sequence, libcamera::ControlList const &metadata,
+				   libcamera::ControlList &applied);
+
+	// Stop watching requests that were cancelled or re-queued without their controls.
+	void ClearInFlight();
+
+	// Frames between a control's request completing and it appearing in the metadata, or 0 if not yet known.
+	unsigned int Delay(unsigned int id) const;
+
+private:
+	// Give up watching for a control after this many frames, e.g. if the camera clamped it.
+	static constexpr unsigned int MAX_DELAY = 8;
+
+	struct InFlight
+	{
+		unsigned int id;
+		libcamera::ControlValue value;
+		uint64_t cookie;
+		std::optional<unsigned int> sequence; // set once the request completes
+	};
+
+	static bool matches(libcamera::ControlValue const &actual, libcamera::ControlValue const &requested);
+
+	mutable std::mutex mutex_;
+	std::map<unsigned int, std::map<unsigned int, libcamera::ControlValue>> pending_; // by id, then frame
+	std::map<unsigned int, unsigned int> delays_;
+	// What the last frame's metadata said for each control we've sent, so that only changes teach us a delay.
+	std::map<unsigned int, libcamera::ControlValue> reported_;
+	unsigned int reported_sequence_ = 0;
+	std::vector<InFlight> in_flight_;
+};
@@ -12,6 +12,7 @@
 #include <linux/dma-buf.h>
 #include <linux/dma-heap.h>
 #include <sys/ioctl.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "core/logging.hpp"
@@ -46,6 +47,7 @@ DmaHeap::DmaHeap()
 
 DmaHeap::~DmaHeap()
 {
+	trim(0);
 }
 
 libcamera::UniqueFD DmaHeap::alloc(const char *name, std::size_t size) const
@@ -77,3 +79,126 @@ libcamera::UniqueFD DmaHeap::alloc(const char *name, std::size_t size) const
 
 	return allocFd;
 }
+
+libcamera::SharedFD DmaHeap::acquire(const char *name, std::size_t size, void **mapping)
+{
+	// Buckets are whole pages, and a buffer can be used for anything up to an eighth smaller than it.
+	std::size_t page_size = sysconf(_SC_PAGESIZE);
+	std::size_t needed = size;
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	{
+		std::lock_guard<std::mutex> lock(poolMutex_);
+		auto it = pool_.lower_bound(size);
+		if (it != pool_.end() && it->first - size <= size / 8)
+		{
+			Buffer buffer = std::move(it->second);
+			pool_.erase(it);
+			pooledBytes_ -= buffer.size;
+			hits_++;
+
+			// This fails if a device still has the buffer attached, but the name is only for debugging.
+			if (::ioctl(buffer.fd.get(), DMA_BUF_SET_NAME, name) < 0)
+				LOG(2, "dmaHeap renaming failure for " << name);
+
+			// Only a mapping of exactly the size asked for can be re-used, because the caller will hand back
+			// that size when it releases the buffer, and anything beyond it would never be unmapped.
+			if (buffer.mapping && buffer.mappingSize != needed)
+			{
+				munmap(buffer.mapping, buffer.mappingSize);
+				buffer.mapping = nullptr;
+			}
+
+			*mapping = buffer.mapping;
+			libcamera::SharedFD fd = buffer.fd;
+			inUse_.emplace(fd.get(), std::move(buffer));
+			return fd;
+		}
+	}
+
+	libcamera::UniqueFD allocFd = alloc(name, size);
+	if (!allocFd.isValid())
+	{
+		// Whatever the pool holds may be what's stopping us, so give it all back and try once more.
+		std::lock_guard<std::mutex> lock(poolMutex_);
+		if (pool_.empty())
+			return {};
+		LOG(1, "Freeing " << pooledBytes_ / 1024 << "kB of pooled buffers to retry allocation");
+		trim(0);
+		allocFd = alloc(name, size);
+		if (!allocFd.isValid())
+			return {};
+	}
+
+	std::lock_guard<std::mutex> lock(poolMutex_);
+	misses_++;
+	*mapping = nullptr;
+	libcamera::SharedFD fd(std::move(allocFd));
+	inUse_.emplace(fd.get(), Buffer { fd, size, nullptr, 0 });
+	return fd;
+}
+
+bool DmaHeap::release(libcamera::SharedFD const &fd, void *mapping, std::size_t mappingSize)
+{
+	std::lock_guard<std::mutex> lock(poolMutex_);
+
+	auto it = inUse_.find(fd.get());
+	if (it == inUse_.end())
+		return false;
+
+	Buffer buffer = std::move(it->second);
+	inUse_.erase(it);
+	// The caller may have mapped it since we handed it out.
+	if (mapping)
+	{
+		buffer.mapping = mapping;
+		buffer.mappingSize = mappingSize;
+	}
+
+	if (buffer.size > poolLimit_)
+	{
+		freeBuffer(buffer);
+		return true;
+	}
+
+	trim(poolLimit_ - buffer.size);
+	pooledBytes_ += buffer.size;
+	pool_.emplace(buffer.size, std::move(buffer));
+	return true;
+}
+
+void DmaHeap::setPoolLimit(std::size_t bytes)
+{
+	std::lock_guard<std::mutex> lock(poolMutex_);
+	poolLimit_ = bytes;
+	trim(poolLimit_);
+}
+
+void DmaHeap::logPoolStats() const
+{
+	std::lock_guard<std::mutex> lock(poolMutex_);
+	if (!poolLimit_)
+		return;
+	LOG(2, "Buffer pool: " << hits_ << " reused, " << misses_ << " allocated, " << evictions_ << " evicted, "
+						   << pool_.size() << " held (" << pooledBytes_ / 1024 << "kB)");
+}
+
+void DmaHeap::freeBuffer(Buffer &buffer)
+{
+	if (buffer.mapping)
+		munmap(buffer.mapping, buffer.mappingSize);
+	buffer.fd = libcamera::SharedFD();
+}
+
+void DmaHeap::trim(std::size_t limit)
+{
+	// Evict the largest buffers first, as they're the least likely to fit what comes next.
+	while (pooledBytes_ > limit)
+	{
+		auto it = std::prev(pool_.end());
+		pooledBytes_ -= it->first;
+		freeBuffer(it->second);
+		pool_.erase(it);
+		evictions_++;
+	}
+}
@@ -9,6 +9,10 @@
 
 #include <stddef.h>
 
+#include <map>
+#include <mutex>
+
+#include <libcamera/base/shared_fd.h>
 #include <libcamera/base/unique_fd.h>
 
 class DmaHeap
@@ -19,6 +23,34 @@ public:
 	bool isValid() const { return dmaHeapHandle_.isValid(); }
 	libcamera::UniqueFD alloc(const char *name, std::size_t size) const;
 
+	// Pooled allocations. Released buffers are kept, along with any mapping, until they're needed again or the
+	// pool grows past its limit. A limit of 0 (the default) frees them straight away.
+	libcamera::SharedFD acquire(const char *name, std::size_t size, void **mapping);
+	// Returns false if the buffer didn't come from acquire(), leaving it and its mapping to the caller.
+	bool release(libcamera::SharedFD const &fd, void *mapping, std::size_t mappingSize);
+	void setPoolLimit(std::size_t bytes);
+	void logPoolStats() const;
+
 private:
+	struct Buffer
+	{
+		libcamera::SharedFD fd;
+		std::size_t size;
+		void *mapping;
+		std::size_t mappingSize;
+	};
+
+	void freeBuffer(Buffer &buffer);
+	void trim(std::size_t limit);
+
 	libcamera::UniqueFD dmaHeapHandle_;
+
+	mutable std::mutex poolMutex_;
+	std::multimap<std::size_t, Buffer> pool_; // by size
+	std::map<int, Buffer> inUse_; // by fd
+	std::size_t poolLimit_ = 0;
+	std::size_t pooledBytes_ = 0;
+	unsigned int hits_ = 0;
+	unsigned int misses_ = 0;
+	unsigned int evictions_ = 0;
 };
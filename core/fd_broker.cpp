@@ -0,0 +1,279 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fd_broker.cpp - Hand buffer fds to other processes.
+ */
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "core/fd_broker.hpp"
+#include "core/logging.hpp"
+#include "core/thread_policy.hpp"
+
+FdBroker::FdBroker(std::string const &path, uint32_t generation) : path_(path), generation_(generation)
+{
+	sockaddr_un addr = {};
+	addr.sun_family = AF_UNIX;
+	if (path.size() >= sizeof(addr.sun_path))
+		throw std::runtime_error("fd broker socket path too long: " + path);
+	strcpy(addr.sun_path, path.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("failed to create fd broker socket: " + std::string(strerror(errno)));
+
+	// A socket left behind by an earlier run would stop us binding.
+	unlink(path.c_str());
+	if (bind(listen_fd_, (sockaddr *)&addr, sizeof(addr)) < 0 || listen(listen_fd_, 8) < 0)
+	{
+		int err = errno;
+		close(listen_fd_);
+		throw std::runtime_error("failed to listen on " + path + ": " + strerror(err));
+	}
+
+	stop_fd_ = eventfd(0, EFD_CLOEXEC);
+	if (stop_fd_ < 0)
+	{
+		int err = errno;
+		close(listen_fd_);
+		unlink(path.c_str());
+		throw std::runtime_error("failed to create fd broker eventfd: " + std::string(strerror(err)));
+	}
+
+	thread_ = std::thread(&FdBroker::listenThread, this);
+	LOG(2, "Fd broker listening on " << path);
+}
+
+FdBroker::~FdBroker()
+{
+	uint64_t one = 1;
+	if (write(stop_fd_, &one, sizeof(one)) != sizeof(one))
+		LOG_ERROR("Failed to stop fd broker thread");
+	thread_.join();
+
+	Reset();
+	close(stop_fd_);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+void FdBroker::Reset()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (Client const &client : clients_)
+	{
+		close(client.fd);
+		if (client.eventfd >= 0)
+			close(client.eventfd);
+	}
+	for (Entry const &entry : entries_)
+		close(entry.fd);
+	clients_.clear();
+	entries_.clear();
+	indices_.clear();
+	generation_++;
+}
+
+int FdBroker::Index(libcamera::FrameBuffer const *buffer, unsigned int stream)
+{
+	if (!buffer)
+		return -1;
+
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	auto it = indices_.find(buffer);
+	if (it != indices_.end())
+		return it->second;
+
+	// Hold our own reference, so that a consumer connecting later can't be sent an fd that has been closed or
+	// re-used.
+	libcamera::FrameBuffer::Plane const &plane = buffer->planes()[0];
+	int fd = fcntl(plane.fd.get(), F_DUPFD_CLOEXEC, 0);
+	if (fd < 0)
+	{
+		LOG_ERROR("Fd broker failed to duplicate fd: " << strerror(errno));
+		return -1;
+	}
+
+	unsigned int index = entries_.size();
+	Message message = { Message::MAGIC, generation_, index, stream, plane.length };
+	entries_.push_back({ message, fd });
+	indices_[buffer] = index;
+
+	for (auto client = clients_.begin(); client != clients_.end();)
+	{
+		if (send(client->fd, entries_.back()))
+			++client;
+		else
+			client = drop(client);
+	}
+
+	return index;
+}
+
+void FdBroker::Notify()
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	for (Client &client : clients_)
+	{
+		if (client.eventfd < 0 || ++client.count < client.every)
+			continue;
+		client.count = 0;
+		// This can only fail if the consumer hasn't read the count for ~2^64 frames.
+		uint64_t one = 1;
+		if (write(client.eventfd, &one, sizeof(one)) < 0)
+			LOG(2, "Fd broker failed to signal consumer: " << strerror(errno));
+	}
+}
+
+std::vector<FdBroker::Client>::iterator FdBroker::drop(std::vector<Client>::iterator client)
+{
+	// Call with mutex_ held.
+	close(client->fd);
+	if (client->eventfd >= 0)
+		close(client->eventfd);
+	return clients_.erase(client);
+}
+
+bool FdBroker::receive(Client &client)
+{
+	Subscribe subscribe;
+	iovec iov = { &subscribe, sizeof(subscribe) };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	ssize_t len = recvmsg(client.fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+	if (len <= 0)
+		return false; // hung up
+
+	int fd = -1;
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	if (cmsg && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS &&
+		cmsg->cmsg_len == CMSG_LEN(sizeof(int)))
+		memcpy(&fd, CMSG_DATA(cmsg), sizeof(int));
+
+	if (len != sizeof(subscribe) || subscribe.magic != Subscribe::MAGIC || fd < 0)
+	{
+		LOG(1, "Fd broker ignoring bad message from consumer");
+		if (fd >= 0)
+			close(fd);
+		return true;
+	}
+
+	if (client.eventfd >= 0)
+		close(client.eventfd);
+	client.eventfd = fd;
+	client.every = std::max(subscribe.every, 1u);
+	client.count = 0;
+	LOG(2, "Fd broker consumer subscribed to every " << client.every << " frames");
+	return true;
+}
+
+bool FdBroker::send(int client, Entry const &entry)
+{
+	// Never wait for a consumer. One that isn't keeping up with its socket gets disconnected.
+	iovec iov = { const_cast<Message *>(&entry.message), sizeof(entry.message) };
+	alignas(cmsghdr) char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &entry.fd, sizeof(int));
+
+	if (sendmsg(client, &msg, MSG_DONTWAIT | MSG_NOSIGNAL) == sizeof(entry.message))
+		return true;
+
+	LOG(1, "Fd broker dropping consumer: " << strerror(errno));
+	return false;
+}
+
+void FdBroker::listenThread()
+{
+	ThreadPolicy::Apply("broker");
+
+	while (true)
+	{
+		// Consumer sockets become readable when they subscribe or hang up.
+		std::vector<pollfd> fds = { { stop_fd_, POLLIN, 0 }, { listen_fd_, POLLIN, 0 } };
+		uint32_t generation;
+		{
+			std::lock_guard<std::mutex> lock(mutex_);
+			generation = generation_;
+			for (Client const &client : clients_)
+				fds.push_back({ client.fd, POLLIN, 0 });
+		}
+
+		if (poll(fds.data(), fds.size(), -1) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			LOG_ERROR("Fd broker poll failed: " << strerror(errno));
+			return;
+		}
+
+		if (fds[0].revents)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex_);
+
+		// After a Reset() the fds we polled may have been closed, and even re-used.
+		for (unsigned int i = 2; i < fds.size() && generation == generation_; i++)
+		{
+			if (!fds[i].revents)
+				continue;
+			auto it = std::find_if(clients_.begin(), clients_.end(),
+								   [fd = fds[i].fd](Client const &c) { return c.fd == fd; });
+			if (it != clients_.end() && !receive(*it))
+			{
+				drop(it);
+				LOG(2, "Fd broker consumer disconnected");
+			}
+		}
+
+		if (fds[1].revents & POLLIN)
+		{
+			int client = accept4(listen_fd_, nullptr, nullptr, SOCK_CLOEXEC);
+			if (client < 0)
+			{
+				LOG_ERROR("Fd broker accept failed: " << strerror(errno));
+				continue;
+			}
+
+			bool ok = true;
+			for (Entry const &entry : entries_)
+			{
+				if (!(ok = send(client, entry)))
+					break;
+			}
+			if (ok)
+			{
+				clients_.push_back({ client, -1, 1, 0 });
+				LOG(2, "Fd broker consumer connected, sent " << entries_.size() << " buffers");
+			}
+			else
+				close(client);
+		}
+	}
+}
@@ -0,0 +1,103 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * fd_broker.hpp - Hand buffer fds to other processes.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <libcamera/framebuffer.h>
+
+// Passes dmabuf fds to other processes over a Unix domain socket, so that they can map our buffers without
+// needing to be our children or to call pidfd_getfd() on numbers that only mean something to us. Each buffer is
+// given an index the first time it's seen, and every consumer that connects is sent each buffer once, as a
+// Message with the fd attached by SCM_RIGHTS. From then on frames refer to buffers only by index, so a
+// consumer maps each buffer once and a frame costs it no system calls at all.
+//
+// A consumer that wants to be woken for new frames, rather than having to poll for them, sends the broker a
+// Subscribe message with an eventfd attached. The broker adds one to it for each frame (or every Nth frame),
+// so the consumer can sleep in read() or poll() and learn from the count how many frames went by.
+//
+// When the buffers change (e.g. the camera is reconfigured) the broker starts a new generation: it closes all
+// its connections and numbers buffers from 0 again. Consumers should watch the generation published alongside
+// the frames and reconnect when it changes.
+
+class FdBroker
+{
+public:
+	struct Message
+	{
+		static constexpr uint32_t MAGIC = 0x46444252; // "FDBR"
+
+		uint32_t magic;
+		uint32_t generation;
+		uint32_t index; // what frames will call this buffer
+		uint32_t stream; // a number chosen by whoever registered the buffer
+		uint64_t length;
+	};
+
+	struct Subscribe
+	{
+		static constexpr uint32_t MAGIC = 0x46444e54; // "FDNT"
+
+		uint32_t magic;
+		uint32_t every; // only signal every this many frames
+	};
+
+	// Throws if the socket can't be created. A broker replacing an earlier one should carry on from its
+	// generation, so that consumers still holding the old buffers see that they've changed.
+	FdBroker(std::string const &path, uint32_t generation = 0);
+	~FdBroker();
+
+	// Forget every buffer and disconnect all the consumers.
+	void Reset();
+
+	// Returns the buffer's index, sending it to the connected consumers if this is the first we've heard of it,
+	// or -1 if there is no buffer.
+	int Index(libcamera::FrameBuffer const *buffer, unsigned int stream);
+
+	// Tell the subscribed consumers that another frame is ready.
+	void Notify();
+
+	uint32_t Generation() const { return generation_; }
+	std::string const &Path() const { return path_; }
+
+private:
+	struct Entry
+	{
+		Message message;
+		int fd;
+	};
+
+	struct Client
+	{
+		int fd;
+		int eventfd;
+		unsigned int every;
+		unsigned int count;
+	};
+
+	void listenThread();
+	bool send(int client, Entry const &entry);
+	bool receive(Client &client);
+	std::vector<Client>::iterator drop(std::vector<Client>::iterator client);
+
+	std::string path_;
+	int listen_fd_ = -1;
+	int stop_fd_ = -1;
+	std::atomic<uint32_t> generation_ { 0 };
+	std::mutex mutex_;
+	std::map<libcamera::FrameBuffer const *, unsigned int> indices_;
+	std::vector<Entry> entries_;
+	std::vector<Client> clients_;
+	std::thread thread_;
+};
@@ -0,0 +1,79 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_pairer.cpp - Match up frames from several cameras by sensor timestamp.
+ */
+
+#include <algorithm>
+
+#include <libcamera/control_ids.h>
+
+#include "core/frame_pairer.hpp"
+
+FramePairer::FramePairer(unsigned int num_cameras, uint64_t tolerance_ns)
+	: waiting_(num_cameras), tolerance_ns_(tolerance_ns)
+{
+}
+
+uint64_t FramePairer::timestamp(CompletedRequestPtr const &request)
+{
+	auto ts = request->metadata.get(libcamera::controls::SensorTimestamp);
+	return ts ? *ts : request->buffers.begin()->second->metadata().timestamp;
+}
+
+CompletedRequestPtr FramePairer::Add(CompletedRequestPtr &request)
+{
+	// Dropped frames are only released once the lock is gone, because that re-queues their requests.
+	std::vector<CompletedRequestPtr> dropped;
+	std::lock_guard<std::mutex> lock(mutex_);
+
+	std::deque<CompletedRequestPtr> &queue = waiting_[request->camera];
+	queue.push_back(std::move(request));
+	if (queue.size() > MAX_WAITING)
+	{
+		dropped.push_back(std::move(queue.front()));
+		queue.pop_front();
+	}
+
+	while (std::all_of(waiting_.begin(), waiting_.end(), [](auto const &q) { return !q.empty(); }))
+	{
+		uint64_t latest = 0;
+		for (auto const &q : waiting_)
+			latest = std::max(latest, timestamp(q.front()));
+
+		// Anything too far behind the latest frame can never be matched now.
+		bool matched = true;
+		for (auto &q : waiting_)
+		{
+			if (timestamp(q.front()) + tolerance_ns_ < latest)
+			{
+				dropped.push_back(std::move(q.front()));
+				q.pop_front();
+				matched = false;
+			}
+		}
+		if (!matched)
+			continue;
+
+		CompletedRequestPtr group = std::move(waiting_[0].front());
+		waiting_[0].pop_front();
+		for (unsigned int i = 1; i < waiting_.size(); i++)
+		{
+			group->paired.push_back(std::move(waiting_[i].front()));
+			waiting_[i].pop_front();
+		}
+		dropped_ += dropped.size();
+		return group;
+	}
+
+	dropped_ += dropped.size();
+	return nullptr;
+}
+
+void FramePairer::Clear()
+{
+	std::vector<std::deque<CompletedRequestPtr>> waiting(waiting_.size());
+	std::lock_guard<std::mutex> lock(mutex_);
+	waiting_.swap(waiting);
+}
@@ -0,0 +1,42 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_pairer.hpp - Match up frames from several cameras by sensor timestamp.
+ */
+
+#pragma once
+
+#include <deque>
+#include <mutex>
+#include <vector>
+
+#include "core/completed_request.hpp"
+
+// Collects the frames from a number of cameras and groups together those whose sensor timestamps lie within
+// the tolerance of each other. Camera 0's frame is returned with the others in its paired list. A frame with
+// nothing to match it is dropped (releasing its buffers) once a later frame from another camera shows that
+// no match is coming, or when too many are waiting.
+
+class FramePairer
+{
+public:
+	FramePairer(unsigned int num_cameras, uint64_t tolerance_ns);
+
+	// Returns a complete group if this frame finished one, and otherwise nothing.
+	CompletedRequestPtr Add(CompletedRequestPtr &request);
+	void Clear();
+
+	uint64_t Dropped() const { return dropped_; }
+
+private:
+	// Waiting frames hold on to their buffers, so don't let them pile up.
+	static constexpr unsigned int MAX_WAITING = 2;
+
+	static uint64_t timestamp(CompletedRequestPtr const &request);
+
+	std::mutex mutex_;
+	std::vector<std::deque<CompletedRequestPtr>> waiting_;
+	uint64_t tolerance_ns_;
+	uint64_t dropped_ = 0;
+};
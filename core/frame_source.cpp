@@ -0,0 +1,365 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_source.cpp - Sources of frames that stand in for the camera.
+ */
+
+#include <fcntl.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/udmabuf.h>
+
+#include <chrono>
+#include <condition_variable>
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <queue>
+#include <thread>
+
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include <libcamera/control_ids.h>
+#include <libcamera/formats.h>
+
+#include "core/frame_source.hpp"
+#include "core/logging.hpp"
+#include "core/options.hpp"
+#include "core/thread_policy.hpp"
+
+using libcamera::ControlList;
+using libcamera::ControlValue;
+using libcamera::FrameBuffer;
+
+namespace
+{
+
+// libcamera only lets its subclasses fill in a stream's configuration.
+class ReplayStream : public libcamera::Stream
+{
+public:
+	ReplayStream(libcamera::StreamConfiguration const &config) { configuration_ = config; }
+};
+
+// Replays a file of raw YUV420 frames, such as rpicam-vid writes with "--codec yuv420", optionally with
+// the metadata that was saved alongside them. Frames go into memfd buffers, which are turned into dmabufs
+// through /dev/udmabuf when we can, so that consumers that import buffers by fd work too.
+class ReplayFrameSource : public FrameSource
+{
+public:
+	ReplayFrameSource(Options const *options);
+	~ReplayFrameSource() override;
+
+	std::string Name() const override { return "replay"; }
+	libcamera::Stream *Configure(std::vector<std::unique_ptr<FrameBuffer>> &buffers) override;
+	void Start(FrameCallback frame_callback, EndCallback end_callback) override;
+	void Stop() override;
+	void Release(FrameBuffer *buffer) override;
+	bool Syncable() const override { return syncable_; }
+
+private:
+	void readMetadata(std::string const &filename);
+	int allocBuffer(std::size_t size);
+	void unmapBuffers();
+	void replayThread();
+
+	Options const *options_;
+	int fd_;
+	unsigned int width_, height_;
+	std::size_t frame_size_;
+	uint64_t num_frames_;
+	uint64_t frame_ = 0;
+	std::vector<ControlList> metadata_;
+	std::unique_ptr<ReplayStream> stream_;
+	std::map<FrameBuffer *, libcamera::Span<uint8_t>> memory_;
+	bool syncable_ = true;
+	std::mutex mutex_;
+	std::condition_variable cond_;
+	std::queue<FrameBuffer *> free_buffers_;
+	bool abort_ = false;
+	std::thread thread_;
+	FrameCallback frame_callback_;
+	EndCallback end_callback_;
+};
+
+ReplayFrameSource::ReplayFrameSource(Options const *options) : options_(options)
+{
+	width_ = options_->Get().width;
+	height_ = options_->Get().height;
+	if (!width_ || !height_ || (width_ & 1) || (height_ & 1))
+		throw std::runtime_error("replay needs an even --width and --height");
+	frame_size_ = width_ * height_ * 3 / 2;
+
+	fd_ = open(options_->Get().replay.c_str(), O_RDONLY | O_CLOEXEC);
+	struct stat info;
+	if (fd_ < 0 || fstat(fd_, &info) < 0)
+		throw std::runtime_error("failed to open replay file " + options_->Get().replay);
+	num_frames_ = info.st_size / frame_size_;
+	if (!num_frames_)
+		throw std::runtime_error("replay file " + options_->Get().replay + " holds no complete frames");
+
+	if (!options_->Get().replay_metadata.empty())
+		readMetadata(options_->Get().replay_metadata);
+
+	LOG(2, "Replay: " << num_frames_ << " frames of " << width_ << "x" << height_ << " from "
+					  << options_->Get().replay << ", " << metadata_.size() << " metadata records");
+}
+
+ReplayFrameSource::~ReplayFrameSource()
+{
+	Stop();
+	unmapBuffers();
+	close(fd_);
+}
+
+void ReplayFrameSource::readMetadata(std::string const &filename)
+{
+	boost::property_tree::ptree root;
+	boost::property_tree::read_json(filename, root);
+
+	std::map<std::string, libcamera::ControlId const *> ids;
+	for (auto const &[id, control] : libcamera::controls::controls)
+		ids[control->name()] = control;
+
+	// Only scalar controls are restored. Anything else is skipped.
+	for (auto const &frame : root)
+	{
+		ControlList metadata(libcamera::controls::controls);
+		for (auto const &[name, value] : frame.second)
+		{
+			auto it = ids.find(name);
+			if (it == ids.end() || !value.empty())
+				continue;
+
+			std::string const &data = value.data();
+			try
+			{
+				switch (it->second->type())
+				{
+				case libcamera::ControlTypeBool:
+					metadata.set(it->second->id(), ControlValue(data == "true" || data == "1"));
+					break;
+				case libcamera::ControlTypeInteger32:
+					metadata.set(it->second->id(), ControlValue(static_cast<int32_t>(std::stol(data))));
+					break;
+				case libcamera::ControlTypeInteger64:
+					metadata.set(it->second->id(), ControlValue(static_cast<int64_t>(std::stoll(data))));
+					break;
+				case libcamera::ControlTypeFloat:
+					metadata.set(it->second->id(), ControlValue(std::stof(data)));
+					break;
+				default:
+					break;
+				}
+			}
+			catch (std::exception const &e)
+			{
+				LOG(2, "Replay: ignoring metadata " << name << " = " << data);
+			}
+		}
+		metadata_.push_back(std::move(metadata));
+	}
+}
+
+int ReplayFrameSource::allocBuffer(std::size_t size)
+{
+	int memfd = memfd_create("rpicam-replay", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (memfd < 0 || ftruncate(memfd, size) < 0)
+		throw std::runtime_error("failed to allocate replay buffer");
+
+	if (!syncable_)
+		return memfd;
+
+	// udmabuf wants the size to stay fixed.
+	int dmabuf = -1;
+	int dev = open("/dev/udmabuf", O_RDWR | O_CLOEXEC);
+	if (dev >= 0 && fcntl(memfd, F_ADD_SEALS, F_SEAL_SHRINK) == 0)
+	{
+		struct udmabuf_create create = {};
+		create.memfd = memfd;
+		create.flags = UDMABUF_FLAGS_CLOEXEC;
+		create.size = size;
+		dmabuf = ioctl(dev, UDMABUF_CREATE, &create);
+	}
+	if (dev >= 0)
+		close(dev);
+
+	if (dmabuf < 0)
+	{
+		if (!memory_.empty())
+			throw std::runtime_error("failed to make replay buffer into a dmabuf");
+		LOG(1, "Replay: /dev/udmabuf not available, buffers will not be dmabufs");
+		syncable_ = false;
+		return memfd;
+	}
+
+	close(memfd);
+	return dmabuf;
+}
+
+libcamera::Stream *ReplayFrameSource::Configure(std::vector<std::unique_ptr<FrameBuffer>> &buffers)
+{
+	unmapBuffers();
+
+	libcamera::StreamConfiguration config;
+	config.pixelFormat = libcamera::formats::YUV420;
+	config.size = libcamera::Size(width_, height_);
+	config.stride = width_;
+	config.frameSize = frame_size_;
+	config.bufferCount = options_->Get().buffer_count ? options_->Get().buffer_count : 6;
+	config.colorSpace = libcamera::ColorSpace::Smpte170m;
+	stream_ = std::make_unique<ReplayStream>(config);
+
+	std::size_t page_size = sysconf(_SC_PAGESIZE);
+	std::size_t alloc_size = (frame_size_ + page_size - 1) & ~(page_size - 1);
+
+	for (unsigned int i = 0; i < config.bufferCount; i++)
+	{
+		int fd = allocBuffer(alloc_size);
+		void *memory = mmap(NULL, alloc_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (memory == MAP_FAILED)
+		{
+			close(fd);
+			throw std::runtime_error("failed to map replay buffer");
+		}
+
+		std::vector<FrameBuffer::Plane> plane(1);
+		plane[0].fd = libcamera::SharedFD(libcamera::UniqueFD(fd));
+		plane[0].offset = 0;
+		plane[0].length = frame_size_;
+
+		buffers.push_back(std::make_unique<FrameBuffer>(plane));
+		memory_[buffers.back().get()] = libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), alloc_size);
+	}
+
+	return stream_.get();
+}
+
+void ReplayFrameSource::unmapBuffers()
+{
+	for (auto &[buffer, span] : memory_)
+		munmap(span.data(), span.size());
+	memory_.clear();
+}
+
+void ReplayFrameSource::Start(FrameCallback frame_callback, EndCallback end_callback)
+{
+	frame_callback_ = frame_callback;
+	end_callback_ = end_callback;
+	frame_ = 0;
+	abort_ = false;
+	free_buffers_ = {};
+	for (auto const &[buffer, span] : memory_)
+		free_buffers_.push(buffer);
+
+	thread_ = std::thread(&ReplayFrameSource::replayThread, this);
+}
+
+void ReplayFrameSource::Stop()
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		abort_ = true;
+	}
+	cond_.notify_one();
+
+	if (thread_.joinable())
+		thread_.join();
+}
+
+void ReplayFrameSource::Release(FrameBuffer *buffer)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		free_buffers_.push(buffer);
+	}
+	cond_.notify_one();
+}
+
+void ReplayFrameSource::replayThread()
+{
+	ThreadPolicy::Apply("replay");
+
+	using namespace std::chrono;
+
+	// A framerate of zero means go as fast as the buffers come back.
+	double fps = options_->Get().framerate.value_or(DEFAULT_FRAMERATE);
+	nanoseconds period(fps > 0 ? static_cast<int64_t>(1e9 / fps) : 0);
+	steady_clock::time_point next_frame = steady_clock::now();
+
+	while (true)
+	{
+		FrameBuffer *buffer;
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			cond_.wait(lock, [this] { return abort_ || !free_buffers_.empty(); });
+			if (abort_)
+				return;
+			buffer = free_buffers_.front();
+			free_buffers_.pop();
+		}
+
+		if (frame_ == num_frames_)
+		{
+			if (!options_->Get().replay_loop)
+			{
+				LOG(2, "Replay: reached the end of " << options_->Get().replay);
+				end_callback_();
+				return;
+			}
+			frame_ = 0;
+		}
+
+		struct dma_buf_sync dma_sync {};
+		dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_WRITE;
+		if (syncable_ && ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+			LOG_ERROR("Replay: failed to sync dma buf for writing");
+
+		ssize_t ret = pread(fd_, memory_[buffer].data(), frame_size_, frame_ * frame_size_);
+
+		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_WRITE;
+		if (syncable_ && ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+			LOG_ERROR("Replay: failed to sync dma buf for writing");
+
+		if (ret != static_cast<ssize_t>(frame_size_))
+		{
+			LOG_ERROR("Replay: failed to read frame " << frame_ << " from " << options_->Get().replay);
+			end_callback_();
+			return;
+		}
+
+		ControlList metadata = metadata_.empty() ? ControlList(libcamera::controls::controls)
+												 : metadata_[frame_ % metadata_.size()];
+		frame_++;
+
+		if (period.count())
+		{
+			std::this_thread::sleep_until(next_frame);
+			next_frame += period;
+		}
+
+		// Recorded timestamps would make no sense now, so the frames are stamped as they go out.
+		metadata.set(libcamera::controls::SensorTimestamp,
+					 duration_cast<nanoseconds>(steady_clock::now().time_since_epoch()).count());
+		metadata.set(libcamera::controls::FrameWallClock,
+					 duration_cast<nanoseconds>(system_clock::now().time_since_epoch()).count());
+
+		frame_callback_(buffer, metadata);
+	}
+}
+
+} // namespace
+
+FrameSource *FrameSource::Create(Options const *options)
+{
+	if (!options->Get().replay.empty())
+		return new ReplayFrameSource(options);
+
+	return nullptr;
+}
@@ -0,0 +1,46 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_source.hpp - Sources of frames that stand in for the camera.
+ */
+
+#pragma once
+
+#include <functional>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <libcamera/controls.h>
+#include <libcamera/framebuffer.h>
+#include <libcamera/stream.h>
+
+struct Options;
+
+// A FrameSource takes the place of the camera, so that everything downstream of it (post-processing,
+// encoders, outputs and previews) can be run on a machine with no sensor. It provides a single stream
+// and the buffers for it, and delivers frames into those buffers until it is stopped.
+class FrameSource
+{
+public:
+	// Called from the source's own thread with a filled buffer and the metadata for the frame.
+	typedef std::function<void(libcamera::FrameBuffer *, libcamera::ControlList &)> FrameCallback;
+	// Called when the source has no more frames to give.
+	typedef std::function<void()> EndCallback;
+
+	// Returns nullptr when the options don't ask for anything other than the camera.
+	static FrameSource *Create(Options const *options);
+
+	virtual ~FrameSource() {}
+
+	virtual std::string Name() const = 0;
+	// Make the stream, and the buffers that go with it. The caller owns the buffers.
+	virtual libcamera::Stream *Configure(std::vector<std::unique_ptr<libcamera::FrameBuffer>> &buffers) = 0;
+	virtual void Start(FrameCallback frame_callback, EndCallback end_callback) = 0;
+	virtual void Stop() = 0;
+	// Hand a buffer back once nothing is using it any more.
+	virtual void Release(libcamera::FrameBuffer *buffer) = 0;
+	// Whether the buffers are dmabufs that take DMA_BUF_IOCTL_SYNC.
+	virtual bool Syncable() const = 0;
+};
@@ -0,0 +1,168 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_trace.cpp - Per-frame latency tracing.
+ */
+
+#include <pthread.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cinttypes>
+#include <cstdio>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "core/frame_trace.hpp"
+#include "core/logging.hpp"
+
+std::atomic<bool> FrameTrace::enabled_ { false };
+
+namespace
+{
+
+// A thread's events. Only its own thread writes to it, and the oldest events are overwritten when it wraps.
+struct Ring
+{
+	static constexpr unsigned int SIZE = 65536;
+
+	Ring() : events(new FrameTrace::Event[SIZE]), tid(syscall(SYS_gettid))
+	{
+		if (pthread_getname_np(pthread_self(), name, sizeof(name)))
+			snprintf(name, sizeof(name), "%d", tid);
+	}
+
+	std::unique_ptr<FrameTrace::Event[]> events;
+	std::atomic<uint64_t> head { 0 };
+	pid_t tid;
+	char name[16];
+};
+
+// Rings are never freed, so that they outlast the threads that wrote them.
+std::mutex rings_mutex;
+std::vector<std::unique_ptr<Ring>> rings;
+thread_local Ring *thread_ring = nullptr;
+
+char const *point_names[] = { "request complete", "stage", "preview show", "encode submit", "encode done",
+							  "output write" };
+
+} // namespace
+
+void FrameTrace::record(Event const &event)
+{
+	if (!thread_ring)
+	{
+		std::lock_guard<std::mutex> lock(rings_mutex);
+		rings.push_back(std::make_unique<Ring>());
+		thread_ring = rings.back().get();
+	}
+
+	uint64_t head = thread_ring->head.load(std::memory_order_relaxed);
+	thread_ring->events[head % Ring::SIZE] = event;
+	thread_ring->head.store(head + 1, std::memory_order_release);
+}
+
+void FrameTrace::Write(std::string const &filename)
+{
+	std::lock_guard<std::mutex> lock(rings_mutex);
+
+	FILE *fp = fopen(filename.c_str(), "w");
+	if (!fp)
+	{
+		LOG_ERROR("Unable to write frame trace " << filename << ": " << strerror(errno));
+		return;
+	}
+
+	auto for_each_event = [](auto func)
+	{
+		for (auto const &ring : rings)
+		{
+			uint64_t head = ring->head.load(std::memory_order_acquire);
+			for (uint64_t i = head > Ring::SIZE ? head - Ring::SIZE : 0; i < head; i++)
+				func(*ring, ring->events[i % Ring::SIZE]);
+		}
+	};
+
+	// Outputs only know the timestamp that the encoder was given, so that's how we find the frame.
+	std::map<uint32_t, uint64_t> sensor_ns;
+	std::map<int64_t, uint32_t> encoded_frames;
+	for_each_event(
+		[&](Ring const &, Event const &e)
+		{
+			if (e.point == RequestComplete)
+				sensor_ns[e.frame] = e.value;
+			else if (e.point == EncodeSubmit)
+				encoded_frames[e.value] = e.frame;
+		});
+
+	pid_t pid = getpid();
+	char const *sep = "";
+	fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[");
+
+	for (auto const &ring : rings)
+	{
+		fprintf(fp, "%s\n{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":%d,\"tid\":%d,\"args\":{\"name\":\"%s\"}}", sep,
+				pid, ring->tid, ring->name);
+		sep = ",";
+	}
+
+	// Each latency is drawn as an async slice from the sensor timestamp, one per frame, so that Perfetto can
+	// give the distribution of their durations.
+	static char const *latency_names[] = { "sensor to preview", "sensor to encoder", "sensor to output" };
+	std::vector<uint64_t> latencies[3];
+
+	for_each_event(
+		[&](Ring const &ring, Event const &e)
+		{
+			if (e.point == Stage)
+				fprintf(fp,
+						",\n{\"name\":\"%s\",\"cat\":\"stage\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":%d,"
+						"\"tid\":%d,\"args\":{\"frame\":%" PRIu32 "}}",
+						e.name, e.time_ns / 1000.0, (e.end_ns - e.time_ns) / 1000.0, pid, ring.tid, e.frame);
+			else
+				fprintf(fp,
+						",\n{\"name\":\"%s\",\"cat\":\"frame\",\"ph\":\"i\",\"s\":\"t\",\"ts\":%.3f,\"pid\":%d,"
+						"\"tid\":%d,\"args\":{\"frame\":%" PRIu32 ",\"value\":%" PRId64 "}}",
+						point_names[e.point], e.time_ns / 1000.0, pid, ring.tid, e.frame, e.value);
+
+			int latency = e.point == PreviewShow ? 0 : e.point == EncodeDone ? 1 : e.point == OutputWrite ? 2 : -1;
+			uint32_t frame = e.frame;
+			if (e.point == OutputWrite)
+			{
+				auto it = encoded_frames.find(e.value);
+				if (it == encoded_frames.end())
+					return;
+				frame = it->second;
+			}
+			auto sensor = sensor_ns.find(frame);
+			if (latency < 0 || sensor == sensor_ns.end() || sensor->second > e.time_ns)
+				return;
+
+			latencies[latency].push_back(e.time_ns - sensor->second);
+			fprintf(fp,
+					",\n{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"b\",\"id\":%" PRIu32 ",\"ts\":%.3f,\"pid\":%d,"
+					"\"tid\":%d},\n{\"name\":\"%s\",\"cat\":\"latency\",\"ph\":\"e\",\"id\":%" PRIu32
+					",\"ts\":%.3f,\"pid\":%d,\"tid\":%d}",
+					latency_names[latency], frame, sensor->second / 1000.0, pid, ring.tid, latency_names[latency],
+					frame, e.time_ns / 1000.0, pid, ring.tid);
+		});
+
+	fprintf(fp, "\n]}\n");
+	fclose(fp);
+
+	LOG(1, "Frame trace written to " << filename);
+	for (unsigned int i = 0; i < 3; i++)
+	{
+		std::vector<uint64_t> &l = latencies[i];
+		if (l.empty())
+			continue;
+		std::sort(l.begin(), l.end());
+		LOG(1, "    " << latency_names[i] << ": " << l.size() << " frames, p50 " << l[l.size() / 2] / 1000 << "us p99 "
+					  << l[l.size() * 99 / 100] / 1000 << "us max " << l.back() / 1000 << "us");
+	}
+}
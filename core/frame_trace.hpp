@@ -0,0 +1,71 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * frame_trace.hpp - Per-frame latency tracing.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+// Trace points mark each frame as it passes through the pipeline, so that the latency from the sensor to the
+// preview, the encoder and the output can be seen. Every thread records into a ring of its own, so recording
+// takes no lock, and when tracing is off it costs a single relaxed load. The rings are written out as Chrome
+// trace JSON, which Perfetto also reads.
+
+class FrameTrace
+{
+public:
+	enum Point : uint16_t
+	{
+		RequestComplete, // value is the frame's sensor timestamp in ns
+		Stage, // a post-processing stage, lasting until end_ns
+		PreviewShow,
+		EncodeSubmit, // value is the timestamp handed to the encoder in us
+		EncodeDone,
+		OutputWrite, // value is the timestamp handed to the output in us, which identifies the frame
+	};
+
+	struct Event
+	{
+		uint64_t time_ns;
+		uint64_t end_ns;
+		int64_t value;
+		char const *name; // must outlive the trace
+		uint32_t frame;
+		Point point;
+	};
+
+	static void Enable() { enabled_.store(true, std::memory_order_relaxed); }
+	static bool Enabled() { return enabled_.load(std::memory_order_relaxed); }
+	// On the same clock as the sensor timestamps.
+	static uint64_t Now()
+	{
+		return std::chrono::duration_cast<std::chrono::nanoseconds>(
+				   std::chrono::steady_clock::now().time_since_epoch())
+			.count();
+	}
+
+	static void Record(Point point, uint32_t frame, int64_t value = 0)
+	{
+		if (Enabled())
+			record({ Now(), 0, value, nullptr, frame, point });
+	}
+	static void RecordStage(char const *name, uint32_t frame, uint64_t start_ns, uint64_t end_ns)
+	{
+		if (Enabled())
+			record({ start_ns, end_ns, 0, name, frame, Stage });
+	}
+
+	// Only call this once nothing else is recording, such as when the application exits.
+	static void Write(std::string const &filename);
+
+private:
+	static void record(Event const &event);
+
+	static std::atomic<bool> enabled_;
+};
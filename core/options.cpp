@@ -212,6 +212,9 @@ Options::Options()
 			"Lists the available cameras attached to the system.")
 		("camera", value<unsigned int>(&v_->camera)->default_value(0),
 			"Chooses the camera to use. To list the available indexes, use the --list-cameras option.")
+		("extra-cameras", value<std::string>(&v_->extra_cameras_),
+			"Comma separated indexes of further cameras to run in step with --camera. Their frames are paired with "
+			"the main camera's by sensor timestamp and passed along with it")
 		("verbose,v", value<unsigned int>(&v_->verbose)->default_value(1)->implicit_value(2),
 			"Set verbosity level. Level 0 is no output, 1 is default, 2 is verbose.")
 		("config,c", value<std::string>(&v_->config_file)->implicit_value("config.txt"),
@@ -237,6 +240,26 @@ Options::Options()
 			"Set the file name for configuring the post-processing")
 		("post-process-libs", value<std::string>(&v_->post_process_libs),
 			"Set a custom location for the post-processing library .so files")
+		("replay", value<std::string>(&v_->replay),
+			"Replay YUV420 frames from this file instead of using a camera. The frames must be --width by "
+			"--height with no row padding, and are delivered at --framerate (0 = as fast as possible)")
+		("replay-metadata", value<std::string>(&v_->replay_metadata),
+			"JSON metadata file, as written by --metadata, to attach to the replayed frames")
+		("replay-loop", value<bool>(&v_->replay_loop)->default_value(false)->implicit_value(true),
+			"Go back to the start of the replay file, rather than quitting, when it runs out")
+		("trace-file", value<std::string>(&v_->trace_file),
+			"Record when each frame passes through the pipeline, and write it to this file as Chrome trace JSON")
+		("watchdog", value<unsigned int>(&v_->watchdog)->default_value(0),
+			"Warn when the camera, post-processing, encoder or output goes this many frame intervals without "
+			"finishing a frame (0 = never)")
+		("watchdog-shed", value<bool>(&v_->watchdog_shed)->default_value(false)->implicit_value(true),
+			"While the watchdog finds the pipeline backing up, skip preview frames and post-processing stages "
+			"marked \"optional\"")
+		("thread-policy", value<std::string>(&v_->thread_policy),
+			"CPU affinity and scheduling for each role of thread, e.g. preview:cpus=3:fifo=10,encode:cpus=1-2:nice=-5, "
+			"or a JSON file of the same. The roles are preview, pp-output, pp-worker, inference, encode, "
+			"encode-output, encode-poll, audio, replay, display, watchdog, broker and lease, and * stands for any "
+			"other")
 		("nopreview,n", value<bool>(&v_->nopreview)->default_value(false)->implicit_value(true),
 			"Do not show a preview window")
 		("preview,p", value<std::string>(&v_->preview)->default_value("0,0,0,0"),
@@ -303,6 +326,12 @@ Options::Options()
 			"Camera mode for preview as W:H:bit-depth:packing, where packing is P (packed) or U (unpacked)")
 		("buffer-count", value<unsigned int>(&v_->buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for video, raw, and still.")
 		("viewfinder-buffer-count", value<unsigned int>(&v_->viewfinder_buffer_count)->default_value(0), "Number of in-flight requests (and buffers) configured for preview window.")
+		("buffer-count-max", value<unsigned int>(&v_->buffer_count_max)->default_value(0),
+			"Start with the usual number of in-flight requests (and buffers), but add more, up to this many, when the "
+			"application holds on to frames for long enough to starve the camera, and give them back when it doesn't")
+		("buffer-pool", value<unsigned int>(&v_->buffer_pool)->default_value(0),
+			"Keep up to this many MB of freed capture buffers to re-use when the camera is next configured, which makes "
+			"switching between still and preview modes quicker and less likely to fail from memory fragmentation")
 		("no-raw", value<bool>(&v_->no_raw)->default_value(false)->implicit_value(true),
 			"Disable requesting of a RAW stream. Will override any manual mode reqest the mode choice when setting framerate.")
 		("autofocus-mode", value<std::string>(&v_->afMode)->default_value("default"),
@@ -389,6 +418,23 @@ bool OptsInternal::Parse(boost::program_options::variables_map &vm, RPiCamApp *a
 	shutter.set(shutter_);
 	flicker_period.set(flicker_period_);
 
+	extra_cameras.clear();
+	std::stringstream extra_cameras_ss(extra_cameras_);
+	for (std::string index; std::getline(extra_cameras_ss, index, ',');)
+	{
+		try
+		{
+			extra_cameras.push_back(std::stoul(index));
+		}
+		catch (std::exception const &e)
+		{
+			throw std::runtime_error("Invalid extra camera index: " + index);
+		}
+		if (extra_cameras.back() == camera ||
+			std::count(extra_cameras.begin(), extra_cameras.end(), extra_cameras.back()) > 1)
+			throw std::runtime_error("Camera " + index + " is used more than once");
+	}
+
 	if (version)
 	{
 		std::cout << "rpicam-apps build: " << RPiCamAppsVersion() << std::endl;
@@ -688,11 +734,23 @@ void OptsInternal::Print() const
 		std::cerr << "    config file: " << config_file << std::endl;
 	std::cerr << "    info_text:" << info_text << std::endl;
 	std::cerr << "    timeout: " << timeout.get() << "ms" << std::endl;
+	if (!extra_cameras.empty())
+		std::cerr << "    extra-cameras: " << extra_cameras_ << std::endl;
 	std::cerr << "    width: " << width << std::endl;
 	std::cerr << "    height: " << height << std::endl;
 	std::cerr << "    output: " << output << std::endl;
 	std::cerr << "    post_process_file: " << post_process_file << std::endl;
 	std::cerr << "    post_process_libs: " << post_process_libs << std::endl;
+	if (!replay.empty())
+		std::cerr << "    replay: " << replay << (replay_loop ? " (loop)" : "") << std::endl;
+	if (!replay_metadata.empty())
+		std::cerr << "    replay-metadata: " << replay_metadata << std::endl;
+	if (!trace_file.empty())
+		std::cerr << "    trace-file: " << trace_file << std::endl;
+	if (!thread_policy.empty())
+		std::cerr << "    thread-policy: " << thread_policy << std::endl;
+	if (watchdog)
+		std::cerr << "    watchdog: " << watchdog << " frames" << (watchdog_shed ? " (shed)" : "") << std::endl;
 	if (nopreview)
 		std::cerr << "    preview: none" << std::endl;
 	else if (fullscreen)
@@ -754,6 +812,10 @@ void OptsInternal::Print() const
 		std::cerr << "    buffer-count: " << buffer_count << std::endl;
 	if (viewfinder_buffer_count > 0)
 		std::cerr << "    viewfinder-buffer-count: " << viewfinder_buffer_count << std::endl;
+	if (buffer_count_max > 0)
+		std::cerr << "    buffer-count-max: " << buffer_count_max << std::endl;
+	if (buffer_pool > 0)
+		std::cerr << "    buffer-pool: " << buffer_pool << "MB" << std::endl;
 	std::cerr << "    metadata: " << metadata << std::endl;
 	std::cerr << "    metadata-format: " << metadata_format << std::endl;
 }
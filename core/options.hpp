@@ -190,6 +190,13 @@ struct OptsInternal
 	std::string output;
 	std::string post_process_file;
 	std::string post_process_libs;
+	std::string replay;
+	std::string replay_metadata;
+	bool replay_loop;
+	std::string trace_file;
+	std::string thread_policy;
+	unsigned int watchdog;
+	bool watchdog_shed;
 	unsigned int width;
 	unsigned int height;
 	bool nopreview;
@@ -230,12 +237,15 @@ struct OptsInternal
 	unsigned int lores_height;
 	bool lores_par;
 	unsigned int camera;
+	std::vector<unsigned int> extra_cameras;
 	std::string mode_string;
 	Mode mode;
 	std::string viewfinder_mode_string;
 	Mode viewfinder_mode;
 	unsigned int buffer_count;
 	unsigned int viewfinder_buffer_count;
+	unsigned int buffer_count_max;
+	unsigned int buffer_pool;
 	std::string afMode;
 	int afMode_index;
 	std::string afRange;
@@ -260,6 +270,7 @@ struct OptsInternal
 	std::string timeout_;
 	std::string shutter_;
 	std::string flicker_period_;
+	std::string extra_cameras_;
 
 	Bitrate bitrate;
 	std::string profile;
@@ -5,32 +5,44 @@
  * post_processor.cpp - Post processor implementation.
  */
 
+#include <algorithm>
 #include <dlfcn.h>
 #include <filesystem>
 #include <iostream>
 #include <map>
 
+#include "core/frame_trace.hpp"
 #include "core/options.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/post_processor.hpp"
+#include "core/scratch_pool.hpp"
+#include "core/thread_policy.hpp"
+#include "core/watchdog.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
 #include <boost/property_tree/json_parser.hpp>
 #include <boost/property_tree/ptree.hpp>
 
+#include <libcamera/control_ids.h>
 #include <libcamera/formats.h>
 
 #include "config.h"
 
 namespace fs = std::filesystem;
 
-PostProcessor::PostProcessor(RPiCamApp *app) : app_(app)
+PostProcessor::PostProcessor(RPiCamApp *app)
+	: app_(app), num_threads_(std::max(1u, std::thread::hardware_concurrency())), max_in_flight_(16),
+	  pipeline_(false), stats_interval_(5)
 {
 }
 
 PostProcessor::~PostProcessor()
 {
+	if (stats_ && stats_->num_stages)
+		LOG(1, stats_->ToString());
+	PostProcessorStats::Destroy(stats_);
+
 	// Must clear stages_ before dynamic_stages_ as the latter will unload the necessary symbols.
 	stages_.clear();
 	dynamic_stages_.clear();
@@ -93,6 +105,18 @@ void PostProcessor::Read(std::string const &filename)
 
 				LOG(1, "Postprocessing requested lores: " << lores_width << "x" << lores_height << " " << lores_format);
 			}
+
+			num_threads_ = node.get<unsigned int>("post_process.threads", num_threads_);
+			max_in_flight_ = node.get<unsigned int>("post_process.max_in_flight", max_in_flight_);
+			pipeline_ = node.get<bool>("post_process.pipeline", pipeline_);
+			stats_file_ = node.get<std::string>("post_process.stats_file", stats_file_);
+			stats_interval_ = node.get<unsigned int>("post_process.stats_interval", stats_interval_);
+			if (node.find("post_process.scratch_limit") != node.not_found() ||
+				node.find("post_process.huge_pages") != node.not_found())
+				ScratchPool::Get().Configure(node.get<std::size_t>("post_process.scratch_limit", 64) << 20,
+											 node.get<bool>("post_process.huge_pages", false));
+			if (!num_threads_ || !max_in_flight_)
+				throw std::runtime_error("post_process.threads and post_process.max_in_flight must be non-zero");
 		}
 		else
 		{
@@ -102,6 +126,20 @@ void PostProcessor::Read(std::string const &filename)
 				LOG(1, "Reading post processing stage \"" << key_and_value.first << "\"");
 				stage->Read(key_and_value.second);
 				stages_.push_back(StagePtr(stage));
+
+				StageConfig config;
+				std::string ordering = key_and_value.second.get<std::string>("ordering", "ordered");
+				if (ordering == "parallel-safe")
+					config.parallel_safe = true;
+				else if (ordering != "ordered")
+					throw std::runtime_error("Unknown ordering \"" + ordering + "\" for stage " + key_and_value.first);
+				config.optional = key_and_value.second.get<bool>("optional", false);
+				config.run_every = key_and_value.second.get<unsigned int>("run_every", 1);
+				config.max_rate = key_and_value.second.get<double>("max_rate", 0);
+				config.latency_budget_ns = key_and_value.second.get<double>("latency_budget_ms", 0) * 1000000;
+				if (!config.run_every || config.max_rate < 0)
+					throw std::runtime_error("Bad run_every or max_rate for stage " + key_and_value.first);
+				stage_config_.push_back(config);
 			}
 			else
 				LOG(1, "No post processing stage found for \"" << key_and_value.first << "\"");
@@ -139,8 +177,37 @@ void PostProcessor::Configure()
 void PostProcessor::Start()
 {
 	quit_ = false;
+	head_ = next_job_ = tail_ = 0;
+	jobs_ = std::vector<Job>(max_in_flight_);
+
+	// The stats accumulate over the lifetime of the post-processor, across camera restarts.
+	if (!stats_)
+	{
+		stats_ = PostProcessorStats::Create(stats_file_);
+		stats_->num_stages = std::min<unsigned int>(stages_.size(), PostProcessorStats::MAX_STAGES);
+		for (unsigned int i = 0; i < stats_->num_stages; i++)
+			snprintf(stats_->stages[i].name, sizeof(stats_->stages[i].name), "%s", stages_[i]->Name());
+	}
+	last_stats_time_ = std::chrono::steady_clock::now();
+
 	output_thread_ = std::thread(&PostProcessor::outputThread, this);
 
+	if (!stages_.empty() && pipeline_)
+	{
+		for (unsigned int i = 0; i < stages_.size(); i++)
+			workers_.emplace_back(&PostProcessor::laneThread, this, i);
+		LOG(2, "Post processing pipelined over " << stages_.size() << " lane(s), " << max_in_flight_
+												 << " request(s) in flight");
+	}
+	else if (!stages_.empty())
+	{
+		// There's no point in having more workers than jobs that can be in flight.
+		unsigned int num_workers = std::min(num_threads_, max_in_flight_);
+		for (unsigned int i = 0; i < num_workers; i++)
+			workers_.emplace_back(&PostProcessor::workerThread, this);
+		LOG(2, "Post processing with " << num_workers << " worker(s), " << max_in_flight_ << " request(s) in flight");
+	}
+
 	for (auto &stage : stages_)
 	{
 		stage->Start();
@@ -156,31 +223,194 @@ void PostProcessor::Process(CompletedRequestPtr &request)
 	}
 
 	std::unique_lock<std::mutex> l(mutex_);
-	requests_.push(std::move(request)); // caller has given us ownership of this reference
+	stats_->requests++;
 
-	std::promise<bool> promise;
-	auto process_fn = [this](CompletedRequestPtr &request, std::promise<bool> promise) {
-		bool drop_request = false;
-		for (auto &stage : stages_)
+	// If the window is full the workers can't keep up. Leaving the request with the caller
+	// drops it, returning the buffers to the camera rather than stalling it.
+	if (tail_ - head_ == jobs_.size())
+	{
+		stats_->window_dropped++;
+		LOG(2, "Post processing window full, dropping request " << request->sequence);
+		return;
+	}
+
+	Job &job = jobs_[tail_ % jobs_.size()];
+	job.request = std::move(request); // caller has given us ownership of this reference
+	job.stage = 0;
+	job.drop = false;
+	job.done = false;
+	tail_++;
+	updateGauges();
+	Watchdog::Enter(Watchdog::Stages);
+
+	if (pipeline_)
+		stage_cv_.notify_all();
+	else
+		job_cv_.notify_one();
+}
+
+bool PostProcessor::stageReady(uint64_t seq, unsigned int stage) const
+{
+	// Each stage must see requests in the order they completed, so a job may only enter
+	// a stage once the job in front of it has left that stage (or been output already).
+	// Stages marked as parallel-safe don't care.
+	if (stage_config_[stage].parallel_safe)
+		return true;
+
+	// A job that was dropped before reaching this stage never will, so look past it to
+	// the job in front of that.
+	for (; seq != head_; seq--)
+	{
+		Job const &prev = jobs_[(seq - 1) % jobs_.size()];
+		if (prev.stage > stage || !prev.drop)
+			return prev.stage > stage;
+	}
+
+	return true;
+}
+
+void PostProcessor::workerThread()
+{
+	ThreadPolicy::Apply("pp-worker");
+
+	std::unique_lock<std::mutex> l(mutex_);
+
+	while (true)
+	{
+		job_cv_.wait(l, [this] { return quit_ || next_job_ != tail_; });
+
+		// Only quit once every queued job has been picked up.
+		if (next_job_ == tail_)
+			break;
+
+		uint64_t seq = next_job_++;
+		Job &job = jobs_[seq % jobs_.size()];
+		updateGauges();
+
+		while (!job.done)
 		{
-			if (stage->Process(request))
-			{
-				drop_request = true;
-				break;
-			}
+			unsigned int stage = job.stage;
+			stage_cv_.wait(l, [this, seq, stage] { return stageReady(seq, stage); });
+
+			bool skip = skipStage(stage, *job.request);
+			l.unlock();
+			bool drop_request = !skip && runStage(stage, job.request);
+			l.lock();
+
+			finishStage(job, stage, drop_request);
 		}
-		promise.set_value(drop_request);
-		cv_.notify_one();
-	};
+	}
+}
+
+void PostProcessor::laneThread(unsigned int stage)
+{
+	ThreadPolicy::Apply("pp-worker", stage);
+
+	std::unique_lock<std::mutex> l(mutex_);
 
-	// Queue the futures to ensure we have correct ordering in the output thread. The promise/future return value
-	// tells us when all the streams for this request have been processed and output_ready_callback_ can be called.
-	futures_.push(promise.get_future());
-	std::thread { process_fn, std::ref(requests_.back()), std::move(promise) }.detach();
+	// Each lane walks the jobs in order, taking each one from the lane before it. A job
+	// that was dropped upstream may already have been output (and its slot reused), in
+	// which case seq < head_ and there is nothing for this lane to do.
+	for (uint64_t seq = 0;; seq++)
+	{
+		stage_cv_.wait(l, [this, seq, stage] {
+			return (quit_ && seq == tail_) || seq < head_ ||
+				   (seq < tail_ && (jobs_[seq % jobs_.size()].stage == stage || jobs_[seq % jobs_.size()].done));
+		});
+
+		if (seq == tail_)
+			break;
+		if (seq < head_)
+			continue;
+
+		Job &job = jobs_[seq % jobs_.size()];
+		if (job.done)
+			continue;
+
+		if (stage == 0)
+		{
+			next_job_ = seq + 1;
+			updateGauges();
+		}
+
+		bool skip = skipStage(stage, *job.request);
+		l.unlock();
+		bool drop_request = !skip && runStage(stage, job.request);
+		l.lock();
+
+		finishStage(job, stage, drop_request);
+	}
+}
+
+bool PostProcessor::skipStage(unsigned int stage, CompletedRequest const &request)
+{
+	// Call with mutex_ held.
+	StageConfig &config = stage_config_[stage];
+	auto now = std::chrono::steady_clock::now();
+	bool skip = config.offered++ % config.run_every != 0;
+
+	if (!skip && config.max_rate)
+		skip = now - config.last_run < std::chrono::duration<double>(1 / config.max_rate);
+
+	if (!skip && config.latency_budget_ns)
+	{
+		auto ts = request.metadata.get(libcamera::controls::SensorTimestamp);
+		skip = ts && FrameTrace::Now() > *ts + config.latency_budget_ns;
+	}
+
+	if (!skip && config.optional)
+		skip = Watchdog::Shedding();
+
+	if (skip && stage < stats_->num_stages)
+		stats_->stages[stage].skipped++;
+	else if (!skip)
+		config.last_run = now;
+
+	return skip;
+}
+
+bool PostProcessor::runStage(unsigned int stage, CompletedRequestPtr &request)
+{
+	unsigned int sequence = request->sequence;
+	auto start = std::chrono::steady_clock::now();
+	bool drop_request = stages_[stage]->Process(request);
+	auto end = std::chrono::steady_clock::now();
+	auto us = std::chrono::duration_cast<std::chrono::microseconds>(end - start);
+
+	FrameTrace::RecordStage(stages_[stage]->Name(), sequence,
+							std::chrono::duration_cast<std::chrono::nanoseconds>(start.time_since_epoch()).count(),
+							std::chrono::duration_cast<std::chrono::nanoseconds>(end.time_since_epoch()).count());
+
+	if (stage < stats_->num_stages)
+		stats_->stages[stage].Record(us.count(), drop_request);
+
+	return drop_request;
+}
+
+void PostProcessor::updateGauges()
+{
+	// Call with mutex_ held.
+	stats_->SetGauges(tail_ - head_, tail_ - next_job_);
+}
+
+void PostProcessor::finishStage(Job &job, unsigned int stage, bool drop_request)
+{
+	// A dropped request skips all the remaining stages, but remembers how far it got.
+	job.stage = stage + 1;
+	job.drop = drop_request;
+	stage_cv_.notify_all();
+
+	if (job.drop || job.stage == stages_.size())
+	{
+		job.done = true;
+		cv_.notify_one();
+	}
 }
 
 void PostProcessor::outputThread()
 {
+	ThreadPolicy::Apply("pp-output");
+
 	while (true)
 	{
 		CompletedRequestPtr request;
@@ -190,18 +420,27 @@ void PostProcessor::outputThread()
 			std::unique_lock<std::mutex> l(mutex_);
 
 			cv_.wait(l, [this] {
-				return (quit_ && futures_.empty()) ||
-					   (!futures_.empty() && futures_.front().wait_for(0s) == std::future_status::ready);
+				return (quit_ && head_ == tail_) || (head_ != tail_ && jobs_[head_ % jobs_.size()].done);
 			});
 
-			// Only quit when the futures_ queue is empty.
-			if (quit_ && futures_.empty())
+			// Only quit when there are no jobs left in flight.
+			if (head_ == tail_)
 				break;
 
-			drop_request = futures_.front().get();
-			futures_.pop();
-			request = std::move(requests_.front()); // reuse as it's being dropped from the queue
-			requests_.pop();
+			Job &job = jobs_[head_ % jobs_.size()];
+			drop_request = job.drop;
+			request = std::move(job.request); // reuse as it's being dropped from the ring
+			head_++;
+			updateGauges();
+		}
+		Watchdog::Leave(Watchdog::Stages);
+
+		auto now = std::chrono::steady_clock::now();
+		if (RPiCamApp::GetVerbosity() >= 2 && stats_interval_ &&
+			now - last_stats_time_ >= std::chrono::seconds(stats_interval_))
+		{
+			LOG(2, stats_->ToString());
+			last_stats_time_ = now;
 		}
 
 		if (!drop_request)
@@ -219,16 +458,31 @@ void PostProcessor::Stop()
 	{
 		std::unique_lock<std::mutex> l(mutex_);
 		quit_ = true;
+		job_cv_.notify_all();
+		stage_cv_.notify_all();
 		cv_.notify_one();
 	}
 
+	// Workers finish any outstanding jobs before exiting, and the output thread drains them.
+	for (auto &worker : workers_)
+		worker.join();
+	workers_.clear();
+
 	output_thread_.join();
 }
 
+void PostProcessor::ReleaseRequests()
+{
+	for (auto &stage : stages_)
+		stage->ReleaseRequests();
+}
+
 void PostProcessor::Teardown()
 {
 	for (auto &stage : stages_)
 	{
 		stage->Teardown();
 	}
+
+	ScratchPool::Get().LogStats();
 }
@@ -9,13 +9,14 @@
 
 #include <chrono>
 #include <condition_variable>
-#include <future>
 #include <mutex>
-#include <queue>
+#include <thread>
+#include <vector>
 
 #include "core/completed_request.hpp"
 #include "core/dl_lib.hpp"
 #include "core/logging.hpp"
+#include "core/post_processor_stats.hpp"
 
 namespace libcamera
 {
@@ -53,21 +54,77 @@ public:
 
 	void Stop();
 
+	// Let stages give back any requests they still hold. Call after Stop(), without camera_stop_mutex_ held.
+	void ReleaseRequests();
+
 	void Teardown();
 
+	// Instrumentation for the stages, valid once the post-processor has been started.
+	PostProcessorStats const *GetStats() const { return stats_; }
+
 private:
 	PostProcessingStage *createPostProcessingStage(char const *name);
 
+	// A request travelling through the stages. Jobs live in a fixed ring that is
+	// allocated once in Start(), so queueing a request never touches the heap.
+	struct Job
+	{
+		CompletedRequestPtr request;
+		unsigned int stage = 0; // index of the next stage to run
+		bool drop = false;
+		bool done = false;
+	};
+
+	// Framework-level settings for each stage, read from its JSON block alongside the
+	// stage's own parameters.
+	struct StageConfig
+	{
+		bool parallel_safe = false; // "ordering": "parallel-safe" lets frames overtake each other
+		bool optional = false; // "optional": true lets the watchdog skip the stage when the pipeline backs up
+		// Skipped frames pass straight on to the next stage.
+		unsigned int run_every = 1; // "run_every": only run on every Nth frame
+		double max_rate = 0; // "max_rate": run at most this many times a second
+		uint64_t latency_budget_ns = 0; // "latency_budget_ms": skip frames already this long since the sensor
+		unsigned int offered = 0; // frames that reached the stage, under mutex_
+		std::chrono::steady_clock::time_point last_run;
+	};
+
+	bool stageReady(uint64_t seq, unsigned int stage) const;
+	bool skipStage(unsigned int stage, CompletedRequest const &request);
+	bool runStage(unsigned int stage, CompletedRequestPtr &request);
+	void updateGauges();
+	void finishStage(Job &job, unsigned int stage, bool drop_request);
+
 	RPiCamApp *app_;
 	std::vector<StagePtr> stages_;
+	std::vector<StageConfig> stage_config_;
 	std::vector<DlLib> dynamic_stages_;
 	void outputThread();
-
-	std::queue<CompletedRequestPtr> requests_;
-	std::queue<std::future<bool>> futures_;
+	void workerThread();
+	void laneThread(unsigned int stage);
+
+	// Executor configuration, may be set in the "rpicam-apps" section of the JSON file.
+	// In pipeline mode each stage gets its own thread (lane) instead of sharing the pool.
+	unsigned int num_threads_;
+	unsigned int max_in_flight_;
+	bool pipeline_;
+	std::string stats_file_;
+	unsigned int stats_interval_;
+
+	// Jobs are numbered consecutively: [head_, tail_) are in flight, next_job_ is the
+	// next one for a worker to pick up. A job's slot is jobs_[seq % jobs_.size()].
+	std::vector<Job> jobs_;
+	uint64_t head_ = 0;
+	uint64_t next_job_ = 0;
+	uint64_t tail_ = 0;
+	std::vector<std::thread> workers_;
 	std::thread output_thread_;
 	bool quit_;
 	PostProcessorCallback callback_;
 	std::mutex mutex_;
 	std::condition_variable cv_;
+	std::condition_variable job_cv_;
+	std::condition_variable stage_cv_;
+	PostProcessorStats *stats_ = nullptr;
+	std::chrono::steady_clock::time_point last_stats_time_;
 };
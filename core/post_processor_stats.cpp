@@ -0,0 +1,142 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * post_processor_stats.cpp - Post processing instrumentation.
+ */
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <cstring>
+#include <new>
+#include <sstream>
+
+#include "core/logging.hpp"
+#include "core/post_processor_stats.hpp"
+
+static void atomic_max(std::atomic<uint64_t> &value, uint64_t sample)
+{
+	uint64_t prev = value.load(std::memory_order_relaxed);
+	while (prev < sample && !value.compare_exchange_weak(prev, sample, std::memory_order_relaxed))
+		;
+}
+
+static void atomic_max(std::atomic<uint32_t> &value, uint32_t sample)
+{
+	uint32_t prev = value.load(std::memory_order_relaxed);
+	while (prev < sample && !value.compare_exchange_weak(prev, sample, std::memory_order_relaxed))
+		;
+}
+
+unsigned int PostProcessingStageStats::Bucket(uint64_t us)
+{
+	if (us < 4)
+		return us;
+
+	// Four buckets for every power of two, indexed by the two bits below the msb.
+	unsigned int msb = 63 - __builtin_clzll(us);
+	unsigned int bucket = 4 * (msb - 1) + ((us >> (msb - 2)) & 3);
+	return std::min(bucket, NUM_BUCKETS - 1);
+}
+
+uint64_t PostProcessingStageStats::BucketLimit(unsigned int bucket)
+{
+	if (bucket < 4)
+		return bucket;
+
+	unsigned int msb = bucket / 4 + 1;
+	return ((uint64_t)(4 + bucket % 4 + 1) << (msb - 2)) - 1;
+}
+
+void PostProcessingStageStats::Record(uint64_t us, bool drop)
+{
+	frames.fetch_add(1, std::memory_order_relaxed);
+	if (drop)
+		dropped.fetch_add(1, std::memory_order_relaxed);
+	total_us.fetch_add(us, std::memory_order_relaxed);
+	atomic_max(max_us, us);
+	histogram[Bucket(us)].fetch_add(1, std::memory_order_relaxed);
+}
+
+uint64_t PostProcessingStageStats::Percentile(double percent) const
+{
+	uint64_t counts[NUM_BUCKETS], total = 0;
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+		total += counts[i] = histogram[i].load(std::memory_order_relaxed);
+
+	if (!total)
+		return 0;
+
+	uint64_t target = std::max<uint64_t>(1, total * percent / 100), seen = 0;
+	for (unsigned int i = 0; i < NUM_BUCKETS; i++)
+	{
+		seen += counts[i];
+		if (seen >= target)
+			return i == NUM_BUCKETS - 1 ? max_us.load(std::memory_order_relaxed) : BucketLimit(i);
+	}
+
+	return max_us.load(std::memory_order_relaxed);
+}
+
+void PostProcessorStats::SetGauges(uint32_t in_flight_now, uint32_t queued_now)
+{
+	in_flight.store(in_flight_now, std::memory_order_relaxed);
+	atomic_max(in_flight_max, in_flight_now);
+	queued.store(queued_now, std::memory_order_relaxed);
+	atomic_max(queued_max, queued_now);
+}
+
+std::string PostProcessorStats::ToString() const
+{
+	std::stringstream ss;
+	ss << "Post processing: " << requests << " requests, " << window_dropped << " dropped (window full), in flight "
+	   << in_flight << " (max " << in_flight_max << "), queued " << queued << " (max " << queued_max << ")";
+
+	for (unsigned int i = 0; i < num_stages; i++)
+	{
+		PostProcessingStageStats const &s = stages[i];
+		uint64_t frames = s.frames;
+		ss << std::endl
+		   << "    " << s.name << ": " << frames << " frames, " << s.dropped << " dropped, " << s.skipped
+		   << " skipped, mean "
+		   << (frames ? s.total_us / frames : 0) << "us p50 " << s.Percentile(50) << "us p99 " << s.Percentile(99)
+		   << "us max " << s.max_us << "us";
+	}
+
+	return ss.str();
+}
+
+PostProcessorStats *PostProcessorStats::Create(std::string const &filename)
+{
+	void *mem = MAP_FAILED;
+
+	if (!filename.empty())
+	{
+		int fd = open(filename.c_str(), O_CREAT | O_RDWR | O_TRUNC | O_CLOEXEC, 0644);
+		if (fd < 0 || ftruncate(fd, sizeof(PostProcessorStats)) < 0)
+			LOG_ERROR("Unable to create post processing stats file " << filename << ": " << strerror(errno));
+		else
+			mem = mmap(nullptr, sizeof(PostProcessorStats), PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+		if (fd >= 0)
+			close(fd);
+	}
+
+	if (mem == MAP_FAILED)
+		mem = mmap(nullptr, sizeof(PostProcessorStats), PROT_READ | PROT_WRITE, MAP_SHARED | MAP_ANONYMOUS, -1, 0);
+	if (mem == MAP_FAILED)
+		throw std::runtime_error("failed to allocate post processing stats");
+
+	PostProcessorStats *stats = new (mem) PostProcessorStats();
+	stats->magic = MAGIC;
+	stats->version = VERSION;
+	return stats;
+}
+
+void PostProcessorStats::Destroy(PostProcessorStats *stats)
+{
+	if (stats)
+		munmap(stats, sizeof(PostProcessorStats));
+}
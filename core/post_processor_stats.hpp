@@ -0,0 +1,67 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * post_processor_stats.hpp - Post processing instrumentation.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <string>
+
+// The stats block is made only of fixed-size fields and lock-free atomics, so it can be
+// placed in a shared file mapping and read by another process while the post-processor
+// updates it. Bump VERSION whenever the layout changes.
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+			  "post processing stats must be lock-free to be shared between processes");
+
+struct PostProcessingStageStats
+{
+	// Latency histogram in microseconds. Bucket boundaries go up in quarter powers of two,
+	// so the last bucket starts at roughly 1s.
+	static constexpr unsigned int NUM_BUCKETS = 80;
+
+	char name[32];
+	std::atomic<uint64_t> frames;
+	std::atomic<uint64_t> dropped; // frames for which the stage's Process() returned true
+	std::atomic<uint64_t> skipped; // frames that the stage's skip policy passed straight on
+	std::atomic<uint64_t> total_us;
+	std::atomic<uint64_t> max_us;
+	std::atomic<uint64_t> histogram[NUM_BUCKETS];
+
+	void Record(uint64_t us, bool drop);
+	// Returns an upper bound on the requested percentile (0 to 100) of the stage latency.
+	uint64_t Percentile(double percent) const;
+
+	static unsigned int Bucket(uint64_t us);
+	static uint64_t BucketLimit(unsigned int bucket);
+};
+
+struct PostProcessorStats
+{
+	static constexpr uint32_t MAGIC = 0x50505354; // "PPST"
+	static constexpr uint32_t VERSION = 2;
+	static constexpr unsigned int MAX_STAGES = 16;
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_stages;
+	std::atomic<uint64_t> requests; // requests given to the post-processor
+	std::atomic<uint64_t> window_dropped; // requests dropped because too many were in flight
+	std::atomic<uint32_t> in_flight; // requests between Process() and the output callback
+	std::atomic<uint32_t> in_flight_max;
+	std::atomic<uint32_t> queued; // requests not yet started by any stage
+	std::atomic<uint32_t> queued_max;
+	PostProcessingStageStats stages[MAX_STAGES];
+
+	void SetGauges(uint32_t in_flight_now, uint32_t queued_now);
+	std::string ToString() const;
+
+	// Create a zeroed stats block, in the named file if one is given (e.g. somewhere in
+	// /dev/shm) so that other processes can map it, otherwise in anonymous memory.
+	static PostProcessorStats *Create(std::string const &filename);
+	static void Destroy(PostProcessorStats *stats);
+};
@@ -10,13 +10,19 @@
 #include "core/frame_info.hpp"
 #include "core/rpicam_app.hpp"
 #include "core/options.hpp"
+#include "core/thread_policy.hpp"
 
 #include <cmath>
+#include <fstream>
 #include <fcntl.h>
+#include <poll.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include <sys/eventfd.h>
 #include <sys/ioctl.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 
 #include <linux/dma-buf.h>
 #include <linux/videodev2.h>
@@ -76,6 +82,105 @@ static void set_pipeline_configuration(Platform platform)
 	}
 }
 
+static constexpr char MODE_CACHE_HEADER[] = "rpicam-apps sensor mode cache 1";
+
+// The cache key covers everything that might change the sensor modes or their framerates.
+static std::string mode_cache_key(std::string const &model, std::string const &id)
+{
+	std::stringstream key;
+	key << model << "|" << id << "|" << libcamera::CameraManager::version();
+
+	struct utsname uts;
+	if (uname(&uts) == 0)
+		key << "|" << uts.release;
+
+	for (char const *var : { "LIBCAMERA_RPI_TUNING_FILE", "LIBCAMERA_RPI_CONFIG_FILE" })
+	{
+		char const *file = getenv(var);
+		struct stat info;
+		key << "|" << (file ? file : "");
+		if (file && stat(file, &info) == 0)
+			key << "@" << info.st_mtime << "," << info.st_size;
+	}
+
+	return key.str();
+}
+
+static std::string mode_cache_file(std::string const &key)
+{
+	char const *cache_home = getenv("XDG_CACHE_HOME");
+	char const *home = getenv("HOME");
+	std::string dir;
+
+	if (cache_home && cache_home[0])
+		dir = cache_home;
+	else if (home && home[0])
+		dir = std::string(home) + "/.cache";
+	else
+		return {};
+
+	std::stringstream file;
+	file << dir << "/rpicam-apps/sensor-modes-" << std::hex << std::hash<std::string>{}(key);
+	return file.str();
+}
+
+static bool load_mode_cache(std::string const &file, std::string const &key, std::vector<RPiCamApp::SensorMode> &modes)
+{
+	std::ifstream in(file);
+	std::string line;
+	if (!std::getline(in, line) || line != MODE_CACHE_HEADER || !std::getline(in, line) || line != key)
+		return false;
+
+	std::vector<RPiCamApp::SensorMode> cached;
+	std::string format;
+	unsigned int width, height;
+	double fps;
+	while (in >> format >> width >> height >> fps)
+		cached.emplace_back(libcamera::Size(width, height), libcamera::PixelFormat::fromString(format), fps);
+	if (!in.eof() || cached.size() != modes.size())
+		return false;
+
+	for (unsigned int i = 0; i < modes.size(); i++)
+	{
+		if (cached[i].format != modes[i].format || cached[i].size != modes[i].size || !(cached[i].fps > 0))
+			return false;
+	}
+
+	modes = std::move(cached);
+	return true;
+}
+
+static void save_mode_cache(std::string const &file, std::string const &key,
+							std::vector<RPiCamApp::SensorMode> const &modes)
+{
+	// Write to a temporary file and rename it, so that nobody ever reads half a cache.
+	std::string dir = file.substr(0, file.rfind('/'));
+	mkdir(dir.substr(0, dir.rfind('/')).c_str(), 0755);
+	mkdir(dir.c_str(), 0755);
+
+	std::string tmp = file + "." + std::to_string(getpid());
+	{
+		std::ofstream out(tmp);
+		out << MODE_CACHE_HEADER << std::endl << key << std::endl;
+		out.precision(17);
+		for (auto const &mode : modes)
+			out << mode.format.toString() << " " << mode.size.width << " " << mode.size.height << " " << mode.fps
+				<< std::endl;
+		if (!out)
+		{
+			LOG(2, "Unable to write sensor mode cache " << file);
+			unlink(tmp.c_str());
+			return;
+		}
+	}
+
+	if (rename(tmp.c_str(), file.c_str()))
+	{
+		LOG(2, "Unable to write sensor mode cache " << file);
+		unlink(tmp.c_str());
+	}
+}
+
 RPiCamApp::RPiCamApp(std::unique_ptr<Options> opts)
 	: options_(std::move(opts)), controls_(controls::controls), post_processor_(this)
 {
@@ -110,6 +215,9 @@ RPiCamApp::~RPiCamApp()
 	StopCamera();
 	Teardown();
 	CloseCamera();
+
+	if (FrameTrace::Enabled())
+		FrameTrace::Write(options_->Get().trace_file);
 }
 
 void RPiCamApp::initCameraManager()
@@ -123,21 +231,48 @@ void RPiCamApp::initCameraManager()
 
 std::string const &RPiCamApp::CameraId() const
 {
-	return camera_->id();
+	return frame_source_ ? frame_source_name_ : camera_->id();
 }
 
 std::string RPiCamApp::CameraModel() const
 {
+	if (frame_source_)
+		return frame_source_->Name();
 	auto model = camera_->properties().get(properties::Model);
 	return model ? *model : camera_->id();
 }
 
 void RPiCamApp::OpenCamera()
 {
+	// Some previews start their own thread straight away, and it has to find the policy in place.
+	ThreadPolicy::Configure(options_->Get().thread_policy);
+
 	// Make a preview window.
 	preview_ = std::unique_ptr<Preview>(make_preview(RPiCamApp::GetOptions()));
 	preview_->SetDoneCallback(std::bind(&RPiCamApp::previewDoneCallback, this, std::placeholders::_1));
 
+	if (!options_->Get().post_process_file.empty())
+	{
+		post_processor_.LoadModules(options_->Get().post_process_libs);
+		post_processor_.Read(options_->Get().post_process_file);
+	}
+	// The queue takes over ownership from the post-processor.
+	post_processor_.SetCallback(
+		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
+
+	// A frame source replaces the camera altogether, so there are no sensor modes to find.
+	frame_source_.reset(FrameSource::Create(options_.get()));
+	if (!options_->Get().trace_file.empty())
+		FrameTrace::Enable();
+	dma_heap_.setPoolLimit((std::size_t)options_->Get().buffer_pool << 20);
+
+	if (frame_source_)
+	{
+		frame_source_name_ = frame_source_->Name();
+		LOG(2, "Using " << frame_source_name_ << " frame source");
+		return;
+	}
+
 	LOG(2, "Opening camera...");
 
 	if (!camera_manager_)
@@ -161,14 +296,27 @@ void RPiCamApp::OpenCamera()
 
 	LOG(2, "Acquired camera " << cam_id);
 
-	if (!options_->Get().post_process_file.empty())
+	for (unsigned int index : options_->Get().extra_cameras)
 	{
-		post_processor_.LoadModules(options_->Get().post_process_libs);
-		post_processor_.Read(options_->Get().post_process_file);
+		if (index >= cameras.size())
+			throw std::runtime_error("extra camera " + std::to_string(index) + " is not available");
+
+		extra_cameras_.push_back(std::make_unique<ExtraCamera>());
+		ExtraCamera &extra = *extra_cameras_.back();
+		extra.camera = cameras[index];
+		if (extra.camera->acquire())
+			throw std::runtime_error("failed to acquire camera " + extra.camera->id());
+		extra.acquired = true;
+
+		LOG(2, "Acquired extra camera " << extra.camera->id());
+	}
+
+	// Frames from different cameras are taken to be simultaneous when they're within half a frame of each other.
+	if (!extra_cameras_.empty())
+	{
+		double fps = options_->Get().framerate.value_or(DEFAULT_FRAMERATE);
+		frame_pairer_ = std::make_unique<FramePairer>(NumCameras(), 0.5e9 / (fps > 0 ? fps : DEFAULT_FRAMERATE));
 	}
-	// The queue takes over ownership from the post-processor.
-	post_processor_.SetCallback(
-		[this](CompletedRequestPtr &r) { this->msg_queue_.Post(Msg(MsgType::RequestComplete, std::move(r))); });
 
 	// We're going to make a list of all the available sensor modes, but we only populate
 	// the framerate field if the user has requested a framerate (as this requires us actually
@@ -188,25 +336,42 @@ void RPiCamApp::OpenCamera()
 	for (const auto &pix : formats.pixelformats())
 	{
 		for (const auto &size : formats.sizes(pix))
+			sensor_modes_.emplace_back(size, pix, 0);
+	}
+
+	// Finding the framerates is slow, so we keep them in a cache, which is only used if it lists
+	// exactly the modes we have just found.
+	std::string cache_key, cache_file;
+	if (options_->Get().framerate)
+	{
+		cache_key = mode_cache_key(CameraModel(), cam_id);
+		cache_file = mode_cache_file(cache_key);
+		if (!cache_file.empty() && load_mode_cache(cache_file, cache_key, sensor_modes_))
 		{
-			double framerate = 0;
-			if (options_->Get().framerate)
-			{
-				SensorMode sensorMode(size, pix, 0);
-				config->at(0).size = size;
-				config->at(0).pixelFormat = pix;
-				config->sensorConfig = libcamera::SensorConfiguration();
-				config->sensorConfig->outputSize = size;
-				config->sensorConfig->bitDepth = sensorMode.depth();
-				config->validate();
-				camera_->configure(config.get());
-				auto fd_ctrl = camera_->controls().find(&controls::FrameDurationLimits);
-				framerate = 1.0e6 / fd_ctrl->second.min().get<int64_t>();
-			}
-			sensor_modes_.emplace_back(size, pix, framerate);
+			LOG(2, "Sensor modes read from " << cache_file);
+			cache_file.clear();
 		}
 	}
 
+	for (SensorMode &sensorMode : sensor_modes_)
+	{
+		if (!options_->Get().framerate || sensorMode.fps > 0)
+			continue;
+
+		config->at(0).size = sensorMode.size;
+		config->at(0).pixelFormat = sensorMode.format;
+		config->sensorConfig = libcamera::SensorConfiguration();
+		config->sensorConfig->outputSize = sensorMode.size;
+		config->sensorConfig->bitDepth = sensorMode.depth();
+		config->validate();
+		camera_->configure(config.get());
+		auto fd_ctrl = camera_->controls().find(&controls::FrameDurationLimits);
+		sensorMode.fps = 1.0e6 / fd_ctrl->second.min().get<int64_t>();
+	}
+
+	if (!cache_file.empty())
+		save_mode_cache(cache_file, cache_key, sensor_modes_);
+
 	if (!log_env_set)
 	{
 		libcamera::logSetLevel("RPI", "INFO");
@@ -218,6 +383,16 @@ void RPiCamApp::CloseCamera()
 {
 	preview_.reset();
 
+	frame_source_.reset();
+
+	frame_pairer_.reset();
+	for (auto &extra : extra_cameras_)
+	{
+		if (extra->acquired)
+			extra->camera->release();
+	}
+	extra_cameras_.clear();
+
 	if (camera_acquired_)
 		camera_->release();
 	camera_acquired_ = false;
@@ -281,6 +456,12 @@ Mode RPiCamApp::selectMode(const Mode &mode) const
 
 void RPiCamApp::ConfigureViewfinder()
 {
+	if (frame_source_)
+	{
+		configureFrameSource("viewfinder");
+		return;
+	}
+
 	LOG(2, "Configuring viewfinder...");
 
 	int lores_stream_num = 0, raw_stream_num = 0;
@@ -360,7 +541,7 @@ void RPiCamApp::ConfigureViewfinder()
 	post_processor_.AdjustConfig("viewfinder", &configuration_->at(0));
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_off" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(stream_roles);
 
 	streams_["viewfinder"] = configuration_->at(0).stream();
 	if (have_lores_stream)
@@ -375,6 +556,12 @@ void RPiCamApp::ConfigureViewfinder()
 
 void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 {
+	if (frame_source_)
+	{
+		configureFrameSource("still");
+		return;
+	}
+
 	LOG(2, "Configuring ZSL...");
 
 	StreamRoles stream_roles = { StreamRole::StillCapture, StreamRole::Viewfinder };
@@ -456,7 +643,7 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 	post_processor_.AdjustConfig("viewfinder", &configuration_->at(1));
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_hq" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(stream_roles);
 
 	streams_["still"] = configuration_->at(0).stream();
 	streams_["viewfinder"] = configuration_->at(1).stream();
@@ -470,6 +657,12 @@ void RPiCamApp::ConfigureZsl(unsigned int still_flags)
 
 void RPiCamApp::ConfigureStill(unsigned int flags)
 {
+	if (frame_source_)
+	{
+		configureFrameSource("still");
+		return;
+	}
+
 	LOG(2, "Configuring still capture...");
 
 	// Always request a raw stream as this forces the full resolution capture mode,
@@ -522,7 +715,7 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 	}
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_hq" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(stream_roles);
 
 	streams_["still"] = configuration_->at(0).stream();
 	if (!options_->Get().no_raw)
@@ -535,6 +728,12 @@ void RPiCamApp::ConfigureStill(unsigned int flags)
 
 void RPiCamApp::ConfigureVideo(unsigned int flags)
 {
+	if (frame_source_)
+	{
+		configureFrameSource("video");
+		return;
+	}
+
 	LOG(2, "Configuring video...");
 
 	bool have_lores_stream = options_->Get().lores_width && options_->Get().lores_height;
@@ -596,7 +795,7 @@ void RPiCamApp::ConfigureVideo(unsigned int flags)
 	configuration_->orientation = libcamera::Orientation::Rotate0 * options_->Get().transform;
 
 	configureDenoise(options_->Get().denoise == "auto" ? "cdn_fast" : options_->Get().denoise);
-	setupCapture();
+	setupCapture(stream_roles);
 
 	streams_["video"] = configuration_->at(0).stream();
 	if (!options_->Get().no_raw)
@@ -618,16 +817,17 @@ void RPiCamApp::Teardown()
 	if (!options_->Get().help)
 		LOG(2, "Tearing down requests, buffers and configuration");
 
+	// Our own buffers go back to the pool, in case the next configuration can use them.
 	for (auto &iter : mapped_buffers_)
-	{
-		// assert(iter.first->planes().size() == iter.second.size());
-		// for (unsigned i = 0; i < iter.first->planes().size(); i++)
-		for (auto &span : iter.second)
-			munmap(span.data(), span.size());
-	}
+		releaseBuffer(iter.first, iter.second);
 	mapped_buffers_.clear();
+	buffer_sync_.clear();
+	adaptive_min_ = adaptive_max_ = 0;
+	dma_heap_.logPoolStats();
 
 	configuration_.reset();
+	for (auto &extra : extra_cameras_)
+		extra->configuration.reset();
 
 	frame_buffers_.clear();
 
@@ -636,9 +836,65 @@ void RPiCamApp::Teardown()
 
 void RPiCamApp::StartCamera()
 {
+	// Post-processing stages have had their chance to change the mapping policies by now.
+	for (auto &[fb, mapped] : mapped_buffers_)
+	{
+		if (mapped.policy == BufferMapPolicy::Eager && !mapBuffer(fb))
+			throw std::runtime_error("failed to map capture buffer");
+	}
+
+	if (frame_source_)
+	{
+		// Each buffer gets a slot of its own, which it finds through its cookie.
+		unsigned int slot = 0;
+		for (auto &[stream, buffers] : frame_buffers_)
+		{
+			for (auto &buffer : buffers)
+			{
+				slot = freeSlot(slot);
+				request_slots_[slot]->request = nullptr;
+				request_slots_[slot]->buffers = { { stream, buffer.get() } };
+				buffer->setCookie(slot++);
+			}
+		}
+
+		camera_started_ = true;
+		timeout_posted_ = false;
+		last_timestamp_ = 0;
+
+		post_processor_.Start();
+		startWatchdog(1000000000 / options_->Get().framerate.value_or(DEFAULT_FRAMERATE));
+
+		frame_source_->Start(std::bind(&RPiCamApp::frameReady, this, std::placeholders::_1, std::placeholders::_2),
+							 [this]() { msg_queue_.Post(Msg(MsgType::Quit)); });
+
+		LOG(2, "Frame source started!");
+		return;
+	}
+
 	// This makes all the Request objects that we shall need.
 	makeRequests();
 
+	// Any requests added or retired last time were left that way.
+	adaptive_count_ = std::count_if(requests_.begin(), requests_.end(),
+									[this](auto const &r) { return request_slots_[r->cookie()]->camera == 0; });
+	adaptive_frames_ = 0;
+	adaptive_low_water_ = UINT_MAX;
+	adaptive_window_start_ = std::chrono::steady_clock::now();
+	hold_max_ns_ = 0;
+	retire_pending_ = false;
+	grow_pending_ = false;
+
+	// The slot table can't grow once requests are completing, so make the slots for any we may add now.
+	if (adaptive_max_ > adaptive_count_)
+	{
+		unsigned int spare = std::count_if(request_slots_.begin(), request_slots_.end(), [](auto const &s) {
+			return !s->request && !s->busy.load(std::memory_order_acquire);
+		});
+		for (; spare < adaptive_max_ - adaptive_count_; spare++)
+			request_slots_.push_back(std::make_unique<RequestSlot>());
+	}
+
 	// Build a list of initial controls that we must set in the camera before starting it.
 	// We don't overwrite anything the application may have set before calling us.
 	if (!controls_.get(controls::ScalerCrop) && !controls_.get(controls::rpi::ScalerCrops))
@@ -799,19 +1055,45 @@ void RPiCamApp::StartCamera()
 		controls_.set(controls::AeFlickerPeriod, options_->Get().flicker_period.get<std::chrono::microseconds>());
 	}
 
+	// Remember these in case we have to restart the camera quickly.
+	initial_controls_ = controls_;
+
+	// Until the first frame says otherwise, assume the slowest frame rate we've asked for.
+	auto frame_durations = controls_.get(controls::FrameDurationLimits);
+	startWatchdog(frame_durations ? (*frame_durations)[1] * 1000 : 1000000000 / DEFAULT_FRAMERATE);
+
+	// Extra cameras get whichever of the controls they support. They start first so that none of the main
+	// camera's early frames go unpaired.
+	for (auto &extra : extra_cameras_)
+	{
+		ControlList controls(controls::controls);
+		for (auto const &[id, value] : controls_)
+		{
+			if (extra->camera->controls().count(id))
+				controls.set(id, value);
+		}
+		if (extra->camera->start(&controls))
+			throw std::runtime_error("failed to start camera " + extra->camera->id());
+		extra->camera->requestCompleted.connect(this, &RPiCamApp::requestComplete);
+	}
+
 	if (camera_->start(&controls_))
 		throw std::runtime_error("failed to start camera");
 	controls_.clear();
 	camera_started_ = true;
+	timeout_posted_ = false;
 	last_timestamp_ = 0;
 
 	post_processor_.Start();
 
 	camera_->requestCompleted.connect(this, &RPiCamApp::requestComplete);
 
+	// Requests may get added as soon as the first ones complete, so hold them off until we're done.
+	std::lock_guard<std::mutex> lock(camera_stop_mutex_);
+	next_sequence_ = sequence_;
 	for (std::unique_ptr<Request> &request : requests_)
 	{
-		if (camera_->queueRequest(request.get()) < 0)
+		if (submitRequest(request.get(), request_slots_[request->cookie()]->camera) < 0)
 			throw std::runtime_error("Failed to queue request");
 	}
 
@@ -820,30 +1102,61 @@ void RPiCamApp::StartCamera()
 
 void RPiCamApp::StopCamera()
 {
+	// Nothing is going to move from here on.
+	Watchdog::Stop();
+
+	// The frame source's thread may be releasing a frame, which takes the lock below, so it has
+	// to be stopped first.
+	if (frame_source_)
+		frame_source_->Stop();
+
 	{
 		// We don't want QueueRequest to run asynchronously while we stop the camera.
 		std::lock_guard<std::mutex> lock(camera_stop_mutex_);
 		if (camera_started_)
 		{
-			if (camera_->stop())
+			if (!frame_source_ && camera_->stop())
 				throw std::runtime_error("failed to stop camera");
+			for (auto &extra : extra_cameras_)
+			{
+				if (extra->camera->stop())
+					throw std::runtime_error("failed to stop camera " + extra->camera->id());
+			}
 
 			post_processor_.Stop();
 
 			camera_started_ = false;
 		}
+
+		// An application might be holding a CompletedRequest, so queueRequest will get
+		// called to release it later, but we need to know not to try and re-queue it.
+		generation_++;
 	}
 
+	// Requests that stages kept hold of can only be given back now that we've let go of the lock.
+	post_processor_.ReleaseRequests();
+
 	if (camera_)
 		camera_->requestCompleted.disconnect(this, &RPiCamApp::requestComplete);
+	for (auto &extra : extra_cameras_)
+		extra->camera->requestCompleted.disconnect(this, &RPiCamApp::requestComplete);
+
+	// Now that the generation has moved on, releasing the unpaired frames won't re-queue them.
+	if (frame_pairer_)
+		frame_pairer_->Clear();
 
-	// An application might be holding a CompletedRequest, so queueRequest will get
-	// called to delete it later, but we need to know not to try and re-queue it.
-	completed_requests_.clear();
+	// Anything still scheduled stays scheduled for when the camera restarts.
+	control_scheduler_.ClearInFlight();
 
 	msg_queue_.Clear();
 
 	requests_.clear();
+	for (auto &slot : request_slots_)
+		slot->request = nullptr;
+
+	if (starvation_events_)
+		LOG(1, "Camera ran out of requests " << starvation_events_ << " times");
+	starvation_events_ = 0;
 
 	controls_.clear(); // no need for mutex here
 
@@ -851,14 +1164,257 @@ void RPiCamApp::StopCamera()
 		LOG(2, "Camera stopped!");
 }
 
+void RPiCamApp::startWatchdog(uint64_t interval_ns)
+{
+	Watchdog::Start(options_->Get().watchdog, options_->Get().watchdog_shed, interval_ns,
+					[this](Watchdog::Stall const &stall) { msg_queue_.Post(Msg(MsgType::Diagnostic, stall)); });
+}
+
+void RPiCamApp::RestartCamera()
+{
+	// There's no hardware to recover with a frame source, and extra cameras need to start in step with the
+	// main one, so either way start everything over.
+	if (frame_source_ || !extra_cameras_.empty())
+	{
+		StopCamera();
+		StartCamera();
+		return;
+	}
+
+	std::unique_lock<std::mutex> lock(camera_stop_mutex_);
+
+	if (!camera_started_)
+	{
+		lock.unlock();
+		StartCamera();
+		return;
+	}
+
+	auto start_time = std::chrono::steady_clock::now();
+
+	// Requests cancelled by stopping the camera must not look like another timeout.
+	camera_started_ = false;
+	if (camera_->stop())
+		throw std::runtime_error("failed to stop camera");
+
+	// Requests that the application still holds keep the same generation, so they get re-queued as
+	// normal when released. Everything else goes straight back to the camera with its original buffers.
+	for (std::unique_ptr<Request> &request : requests_)
+	{
+		RequestSlot *slot = request_slots_[request->cookie()].get();
+		if (slot->busy.load(std::memory_order_acquire))
+			continue;
+
+		request->reuse();
+		for (auto const &[stream, buffer] : slot->buffers)
+		{
+			BufferSyncState *sync = syncState(buffer);
+			if (sync &&
+				sync->state.exchange(BufferSyncState::Idle, std::memory_order_acq_rel) == BufferSyncState::Synced)
+			{
+				struct dma_buf_sync dma_sync {};
+				dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+				if (::ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+					throw std::runtime_error("failed to sync dma buf on restart");
+			}
+
+			if (request->addBuffer(stream, buffer) < 0)
+				throw std::runtime_error("failed to add buffer to request on restart");
+		}
+	}
+
+	// Start with the controls we worked out last time, updated with anything the application has set since.
+	ControlList controls = initial_controls_;
+	{
+		std::lock_guard<std::mutex> control_lock(control_mutex_);
+		for (auto const &c : controls_)
+			controls.set(c.first, c.second);
+		controls_.clear();
+	}
+
+	// The cancelled requests' controls went with them.
+	control_scheduler_.ClearInFlight();
+
+	if (camera_->start(&controls))
+		throw std::runtime_error("failed to restart camera");
+	camera_started_ = true;
+	timeout_posted_ = false;
+	last_timestamp_ = 0;
+
+	// The cancelled requests never got sequence numbers.
+	next_sequence_ = sequence_;
+	for (std::unique_ptr<Request> &request : requests_)
+	{
+		if (request_slots_[request->cookie()]->busy.load(std::memory_order_acquire))
+			continue;
+		if (submitRequest(request.get(), 0) < 0)
+			throw std::runtime_error("Failed to queue request on restart");
+	}
+
+	auto elapsed = std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::steady_clock::now() - start_time);
+	LOG(1, "Camera restarted in " << elapsed.count() << "us");
+}
+
 RPiCamApp::Msg RPiCamApp::Wait()
 {
 	return msg_queue_.Wait();
 }
 
-void RPiCamApp::queueRequest(CompletedRequest *completed_request)
+std::optional<RPiCamApp::Msg> RPiCamApp::TryWait()
+{
+	return msg_queue_.TryWait();
+}
+
+std::optional<RPiCamApp::Msg> RPiCamApp::WaitFor(std::chrono::steady_clock::time_point deadline)
+{
+	return msg_queue_.WaitFor(deadline);
+}
+
+RPiCamApp::MessageQueue::MessageQueue()
+{
+	// Each cell's sequence number says whose turn it is: a producer may fill the cell at position pos when
+	// it equals pos, and the consumer may empty it when it equals pos + 1.
+	for (unsigned int i = 0; i < CAPACITY; i++)
+		cells_[i].sequence.store(i, std::memory_order_relaxed);
+
+	event_fd_ = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (event_fd_ < 0)
+		throw std::runtime_error("failed to create message queue eventfd");
+}
+
+RPiCamApp::MessageQueue::~MessageQueue()
+{
+	close(event_fd_);
+}
+
+void RPiCamApp::MessageQueue::Post(Msg &&msg)
 {
-	BufferMap buffers(std::move(completed_request->buffers));
+	uint64_t pos = tail_.load(std::memory_order_relaxed);
+	Cell *cell;
+
+	while (true)
+	{
+		cell = &cells_[pos % CAPACITY];
+		int64_t diff = (int64_t)cell->sequence.load(std::memory_order_acquire) - (int64_t)pos;
+		if (diff == 0 && tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+			break;
+		else if (diff < 0)
+		{
+			// The queue is full, so the application has stopped reading. Diagnostics aren't worth
+			// waiting for (the watchdog has logged them already), but anything else must get through,
+			// so sleep until the consumer frees this cell.
+			if (msg.type == MsgType::Diagnostic)
+				return;
+			std::unique_lock<std::mutex> lock(full_mutex_);
+			full_waiters_.fetch_add(1);
+			// Pairs with the fence in TryWait(), so that either we see the cell freed or it sees us.
+			std::atomic_thread_fence(std::memory_order_seq_cst);
+			full_cv_.wait(lock, [cell, pos] {
+				return (int64_t)cell->sequence.load(std::memory_order_acquire) - (int64_t)pos >= 0;
+			});
+			full_waiters_.fetch_sub(1);
+			pos = tail_.load(std::memory_order_relaxed);
+		}
+		else if (diff > 0)
+			pos = tail_.load(std::memory_order_relaxed);
+	}
+
+	cell->msg.emplace(std::move(msg));
+	cell->sequence.store(pos + 1, std::memory_order_release);
+
+	// Pairs with the fence in wait(), so that either the consumer sees this message or we see that
+	// it has gone to sleep.
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (sleeping_.exchange(false))
+	{
+		uint64_t one = 1;
+		if (write(event_fd_, &one, sizeof(one)) < 0)
+			LOG_ERROR("Failed to wake message queue: " << strerror(errno));
+	}
+}
+
+std::optional<RPiCamApp::Msg> RPiCamApp::MessageQueue::TryWait()
+{
+	Cell &cell = cells_[head_ % CAPACITY];
+	if (cell.sequence.load(std::memory_order_acquire) != head_ + 1)
+		return std::nullopt;
+
+	std::optional<Msg> msg = std::move(cell.msg);
+	cell.msg.reset();
+	cell.sequence.store(head_ + CAPACITY, std::memory_order_release);
+	head_++;
+
+	std::atomic_thread_fence(std::memory_order_seq_cst);
+	if (full_waiters_.load(std::memory_order_relaxed))
+	{
+		std::lock_guard<std::mutex> lock(full_mutex_);
+		full_cv_.notify_all();
+	}
+	return msg;
+}
+
+RPiCamApp::Msg RPiCamApp::MessageQueue::Wait()
+{
+	return std::move(*wait(true, {}));
+}
+
+std::optional<RPiCamApp::Msg> RPiCamApp::MessageQueue::WaitFor(std::chrono::steady_clock::time_point deadline)
+{
+	return wait(false, deadline);
+}
+
+std::optional<RPiCamApp::Msg> RPiCamApp::MessageQueue::wait(bool forever,
+															 std::chrono::steady_clock::time_point deadline)
+{
+	while (true)
+	{
+		std::optional<Msg> msg = TryWait();
+		if (msg)
+			return msg;
+
+		int timeout_ms = -1;
+		if (!forever)
+		{
+			auto now = std::chrono::steady_clock::now();
+			if (now >= deadline)
+				return std::nullopt;
+			timeout_ms = std::chrono::ceil<std::chrono::milliseconds>(deadline - now).count();
+		}
+
+		sleeping_.store(true);
+		std::atomic_thread_fence(std::memory_order_seq_cst);
+		msg = TryWait();
+		if (msg)
+		{
+			sleeping_.store(false);
+			return msg;
+		}
+
+		struct pollfd pfd = { event_fd_, POLLIN, 0 };
+		poll(&pfd, 1, timeout_ms);
+		sleeping_.store(false);
+
+		uint64_t count;
+		if (read(event_fd_, &count, sizeof(count)) < 0 && errno != EAGAIN)
+			LOG_ERROR("Failed to read message queue eventfd: " << strerror(errno));
+	}
+}
+
+void RPiCamApp::MessageQueue::Clear()
+{
+	while (TryWait())
+		;
+}
+
+void RPiCamApp::queueRequest(RequestSlot *slot)
+{
+	// The request is null for frames from a frame source.
+	Request *request = slot->completed.request;
+
+	// The other cameras' frames go back with this one, but re-queueing them takes the lock below, so they're
+	// only let go of once we've finished with it (they're destroyed after stop_lock).
+	std::vector<CompletedRequestPtr> paired = std::move(slot->completed.paired);
+	slot->completed.paired.clear();
 
 	// This function may run asynchronously so needs protection from the
 	// camera stopping at the same time.
@@ -866,52 +1422,85 @@ void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 
 	// An application could be holding a CompletedRequest while it stops and re-starts
 	// the camera, after which we don't want to queue another request now.
-	bool request_found;
+	if (!camera_started_ || slot->generation != generation_)
 	{
-		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		auto it = completed_requests_.find(completed_request);
-		if (it != completed_requests_.end())
-		{
-			request_found = true;
-			completed_requests_.erase(it);
-		}
-		else
-			request_found = false;
+		slot->busy.store(false, std::memory_order_release);
+		return;
 	}
 
-	Request *request = completed_request->request;
-	delete completed_request;
-	assert(request);
+	if (request && slot->camera == 0 && adaptive_max_ > adaptive_min_)
+	{
+		uint64_t held = std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now() -
+																			 slot->complete_time)
+							.count();
+		uint64_t hold_max = hold_max_ns_.load(std::memory_order_relaxed);
+		while (held > hold_max && !hold_max_ns_.compare_exchange_weak(hold_max, held, std::memory_order_relaxed))
+		{
+		}
 
-	if (!camera_started_ || !request_found)
-		return;
+		if (retire_pending_.exchange(false) && adaptive_count_ > adaptive_min_)
+		{
+			retireRequest(slot);
+			return;
+		}
+		if (grow_pending_.exchange(false) && adaptive_count_ < adaptive_max_)
+			growRequests();
+	}
 
-	for (auto const &p : buffers)
+	for (auto const &p : slot->completed.buffers)
 	{
 		struct dma_buf_sync dma_sync {};
 		dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
 
-		auto it = mapped_buffers_.find(p.second);
-		if (it == mapped_buffers_.end())
+		BufferSyncState *sync = syncState(p.second);
+		if (!sync)
 			throw std::runtime_error("failed to identify queue request buffer");
 
-		int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
-		if (ret)
-			throw std::runtime_error("failed to sync dma buf on queue request");
+		// Only buffers that were synced for the CPU need ending.
+		if (sync->state.exchange(BufferSyncState::Idle, std::memory_order_acq_rel) == BufferSyncState::Synced)
+		{
+			int ret = ::ioctl(p.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
+			if (ret)
+				throw std::runtime_error("failed to sync dma buf on queue request");
+		}
 
-		if (request->addBuffer(p.first, p.second) < 0)
+		if (!request)
+			frame_source_->Release(p.second);
+		else if (request->addBuffer(p.first, p.second) < 0)
 			throw std::runtime_error("failed to add buffer to request in QueueRequest");
 	}
 
+	if (!request)
+	{
+		slot->busy.store(false, std::memory_order_release);
+		return;
+	}
+
+	// Only the main camera takes controls once it's running.
+	if (slot->camera == 0)
 	{
 		std::lock_guard<std::mutex> lock(control_mutex_);
 		request->controls() = std::move(controls_);
 	}
 
-	if (camera_->queueRequest(request) < 0)
+	slot->busy.store(false, std::memory_order_release);
+	if (submitRequest(request, slot->camera) < 0)
 		throw std::runtime_error("failed to queue request");
 }
 
+int RPiCamApp::submitRequest(Request *request, unsigned int camera)
+{
+	if (camera == 0)
+	{
+		// The request will complete once everything already in the camera has.
+		control_scheduler_.Collect(request->controls(), next_sequence_++, request->cookie());
+		requests_in_camera_++;
+		Watchdog::Enter(Watchdog::Camera);
+	}
+
+	return cameraAt(camera)->queueRequest(request);
+}
+
 void RPiCamApp::PostMessage(MsgType &t, MsgPayload &p)
 {
 	msg_queue_.Post(Msg(t, std::move(p)));
@@ -963,6 +1552,22 @@ libcamera::Stream *RPiCamApp::GetMainStream() const
 	return nullptr;
 }
 
+libcamera::Stream *RPiCamApp::CameraStream(unsigned int camera, Stream const *stream) const
+{
+	if (camera == 0)
+		return const_cast<Stream *>(stream);
+	if (camera > extra_cameras_.size() || !configuration_ || !extra_cameras_[camera - 1]->configuration)
+		return nullptr;
+
+	for (unsigned int i = 0; i < configuration_->size(); i++)
+	{
+		if (configuration_->at(i).stream() == stream)
+			return extra_cameras_[camera - 1]->configuration->at(i).stream();
+	}
+
+	return nullptr;
+}
+
 const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 {
 	if (!camera_manager_)
@@ -974,7 +1579,7 @@ const libcamera::CameraManager *RPiCamApp::GetCameraManager()
 void RPiCamApp::ShowPreview(CompletedRequestPtr &completed_request, Stream *stream)
 {
 	std::lock_guard<std::mutex> lock(preview_item_mutex_);
-	if (!preview_item_.stream)
+	if (!preview_item_.stream && !Watchdog::Shedding())
 		preview_item_ = PreviewItem(completed_request, stream); // copy the shared_ptr here
 	else
 		preview_frames_dropped_++;
@@ -992,6 +1597,39 @@ void RPiCamApp::SetControls(const ControlList &controls)
 		controls_.set(c.first, c.second);
 }
 
+void RPiCamApp::SetBufferSyncPolicy(Stream const *stream, BufferSyncPolicy policy)
+{
+	auto it = frame_buffers_.find(const_cast<Stream *>(stream));
+	if (it == frame_buffers_.end())
+		throw std::runtime_error("SetBufferSyncPolicy: unknown stream");
+
+	if (camera_started_)
+		throw std::runtime_error("SetBufferSyncPolicy: camera is running");
+
+	for (auto const &fb : it->second)
+		buffer_sync_[fb.get()].policy = policy;
+}
+
+void RPiCamApp::SetBufferMapPolicy(Stream const *stream, BufferMapPolicy policy)
+{
+	auto it = frame_buffers_.find(const_cast<Stream *>(stream));
+	if (it == frame_buffers_.end())
+		throw std::runtime_error("SetBufferMapPolicy: unknown stream");
+
+	// Requests can be added and retired while the camera runs, changing the stream's buffers under us.
+	if (camera_started_)
+		throw std::runtime_error("SetBufferMapPolicy: camera is running");
+
+	std::unique_lock<std::shared_mutex> lock(buffer_maps_mutex_);
+	for (auto const &fb : it->second)
+		mapped_buffers_[fb.get()].policy = policy;
+}
+
+void RPiCamApp::SetControls(const ControlList &controls, unsigned int sequence)
+{
+	control_scheduler_.Schedule(controls, sequence);
+}
+
 StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 {
 	StreamConfiguration const &cfg = stream->configuration();
@@ -1004,12 +1642,24 @@ StreamInfo RPiCamApp::GetStreamInfo(Stream const *stream) const
 	return info;
 }
 
-void RPiCamApp::setupCapture()
+void RPiCamApp::setupCapture(StreamRoles const &stream_roles)
 {
 	// First finish setting up the configuration.
 
+	// With an adaptive number of requests, the camera is configured for the most we might use, but we only
+	// allocate what we start with.
+	adaptive_min_ = adaptive_max_ = configuration_->at(0).bufferCount;
+	if (options_->Get().buffer_count_max > adaptive_min_ && extra_cameras_.empty())
+		adaptive_max_ = options_->Get().buffer_count_max;
+	else if (options_->Get().buffer_count_max)
+		LOG(1, "Not adapting the number of requests");
+
 	for (auto &config : *configuration_)
+	{
 		config.stride = 0;
+		if (adaptive_max_ > adaptive_min_)
+			config.bufferCount = std::max(config.bufferCount, adaptive_max_);
+	}
 	CameraConfiguration::Status validation = configuration_->validate();
 	if (validation == CameraConfiguration::Invalid)
 		throw std::runtime_error("failed to valid stream configurations");
@@ -1024,67 +1674,204 @@ void RPiCamApp::setupCapture()
 	for (auto const &[id, info] : camera_->controls())
 		LOG(2, "    " << id->name() << " : " << info.toString());
 
+	// Extra cameras run with the same streams as the main one.
+	std::vector<CameraConfiguration *> configurations = { configuration_.get() };
+	for (auto &extra : extra_cameras_)
+	{
+		extra->configuration = extra->camera->generateConfiguration(stream_roles);
+		if (!extra->configuration || extra->configuration->size() != configuration_->size())
+			throw std::runtime_error("failed to generate configuration for camera " + extra->camera->id());
+
+		for (unsigned int i = 0; i < configuration_->size(); i++)
+		{
+			StreamConfiguration &config = extra->configuration->at(i);
+			config.pixelFormat = configuration_->at(i).pixelFormat;
+			config.size = configuration_->at(i).size;
+			config.bufferCount = configuration_->at(i).bufferCount;
+			config.colorSpace = configuration_->at(i).colorSpace;
+			config.stride = 0;
+		}
+		extra->configuration->orientation = configuration_->orientation;
+		extra->configuration->sensorConfig = configuration_->sensorConfig;
+
+		validation = extra->configuration->validate();
+		if (validation == CameraConfiguration::Invalid)
+			throw std::runtime_error("failed to validate stream configurations for camera " + extra->camera->id());
+		else if (validation == CameraConfiguration::Adjusted)
+			LOG(1, "Stream configuration adjusted for camera " << extra->camera->id());
+
+		if (extra->camera->configure(extra->configuration.get()) < 0)
+			throw std::runtime_error("failed to configure streams for camera " + extra->camera->id());
+		configurations.push_back(extra->configuration.get());
+	}
+
 	// Next allocate all the buffers we need, mmap them and store them on a free list.
 
-	for (StreamConfiguration &config : *configuration_)
+	for (CameraConfiguration *configuration : configurations)
 	{
-		Stream *stream = config.stream();
-		std::vector<std::unique_ptr<FrameBuffer>> fb;
-
-		for (unsigned int i = 0; i < config.bufferCount; i++)
+		for (StreamConfiguration &config : *configuration)
 		{
-			std::string name("rpicam-apps" + std::to_string(i));
-			libcamera::UniqueFD fd = dma_heap_.alloc(name.c_str(), config.frameSize);
+			Stream *stream = config.stream();
+			std::vector<std::unique_ptr<FrameBuffer>> fb;
 
-			if (!fd.isValid())
-				throw std::runtime_error("failed to allocate capture buffers for stream");
+			unsigned int count = config.bufferCount;
+			if (configuration == configuration_.get() && adaptive_max_ > adaptive_min_)
+				count = adaptive_min_;
+			for (unsigned int i = 0; i < count; i++)
+			{
+				void *mapping;
+				fb.push_back(allocBuffer("rpicam-apps" + std::to_string(i), config.frameSize, &mapping));
+				if (!fb.back())
+					throw std::runtime_error("failed to allocate capture buffers for stream");
 
-			std::vector<FrameBuffer::Plane> plane(1);
-			plane[0].fd = libcamera::SharedFD(std::move(fd));
-			plane[0].offset = 0;
-			plane[0].length = config.frameSize;
+				setMapping(mapped_buffers_[fb.back().get()], mapping, config.frameSize);
+				buffer_sync_[fb.back().get()];
+			}
 
-			fb.push_back(std::make_unique<FrameBuffer>(plane));
-			void *memory = mmap(NULL, config.frameSize, PROT_READ | PROT_WRITE, MAP_SHARED, plane[0].fd.get(), 0);
-			mapped_buffers_[fb.back().get()].push_back(
-						libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), config.frameSize));
+			frame_buffers_[stream] = std::move(fb);
 		}
-
-		frame_buffers_[stream] = std::move(fb);
 	}
-	LOG(2, "Buffers allocated and mapped");
+	LOG(2, "Buffers allocated");
 
 	startPreview();
 
 	// The requests will be made when StartCamera() is called.
 }
 
+RPiCamApp::MappedBuffer *RPiCamApp::mapBuffer(FrameBuffer *fb)
+{
+	std::shared_lock<std::shared_mutex> maps_lock(buffer_maps_mutex_);
+	auto it = mapped_buffers_.find(fb);
+	if (it == mapped_buffers_.end())
+		return nullptr;
+	// Whoever has the buffer stops it being retired, so the entry stays put without the lock.
+	maps_lock.unlock();
+
+	MappedBuffer &mapped = it->second;
+	if (mapped.mapped.load(std::memory_order_acquire))
+		return &mapped;
+
+	std::lock_guard<std::mutex> lock(mapping_mutex_);
+	if (mapped.mapped.load(std::memory_order_relaxed))
+		return &mapped;
+
+	if (mapped.policy == BufferMapPolicy::Never)
+	{
+		LOG_ERROR("Buffer belongs to a stream that must not be mapped");
+		return nullptr;
+	}
+
+	// We allocated these buffers ourselves in setupCapture(), so there's just the one plane.
+	FrameBuffer::Plane const &plane = fb->planes()[0];
+	void *memory = mmap(NULL, plane.length, PROT_READ | PROT_WRITE, MAP_SHARED, plane.fd.get(), 0);
+	if (memory == MAP_FAILED)
+	{
+		LOG_ERROR("Failed to map capture buffer: " << strerror(errno));
+		return nullptr;
+	}
+	mapped.planes.push_back(libcamera::Span<uint8_t>(static_cast<uint8_t *>(memory), plane.length));
+
+	mapped.mapped.store(true, std::memory_order_release);
+	return &mapped;
+}
+
+std::unique_ptr<libcamera::FrameBuffer> RPiCamApp::allocBuffer(std::string const &name, std::size_t size,
+																void **mapping)
+{
+	libcamera::SharedFD fd = dma_heap_.acquire(name.c_str(), size, mapping);
+	if (!fd.isValid())
+		return nullptr;
+
+	std::vector<FrameBuffer::Plane> plane(1);
+	plane[0].fd = fd;
+	plane[0].offset = 0;
+	plane[0].length = size;
+
+	return std::make_unique<FrameBuffer>(plane);
+}
+
+void RPiCamApp::setMapping(MappedBuffer &mapped, void *mapping, std::size_t size)
+{
+	// Buffers from the pool may still be mapped from last time.
+	if (!mapping)
+		return;
+	mapped.planes = { libcamera::Span<uint8_t>(static_cast<uint8_t *>(mapping), size) };
+	mapped.mapped.store(true, std::memory_order_release);
+}
+
+void RPiCamApp::releaseBuffer(FrameBuffer *fb, MappedBuffer &mapped)
+{
+	void *mapping = mapped.planes.empty() ? nullptr : mapped.planes[0].data();
+	std::size_t size = mapped.planes.empty() ? 0 : mapped.planes[0].size();
+	if (dma_heap_.release(fb->planes()[0].fd, mapping, size))
+		return;
+
+	// Frame source buffers don't come from the heap.
+	for (auto &span : mapped.planes)
+		munmap(span.data(), span.size());
+}
+
+RPiCamApp::BufferSyncState *RPiCamApp::syncState(FrameBuffer *fb)
+{
+	std::shared_lock<std::shared_mutex> lock(buffer_maps_mutex_);
+	auto it = buffer_sync_.find(fb);
+	return it == buffer_sync_.end() ? nullptr : &it->second;
+}
+
+unsigned int RPiCamApp::freeSlot(unsigned int first)
+{
+	// Skip over any slots still held by the application from a previous configuration.
+	unsigned int slot = first;
+	while (slot < request_slots_.size() && request_slots_[slot]->busy.load(std::memory_order_acquire))
+		slot++;
+	if (slot == request_slots_.size())
+		request_slots_.push_back(std::make_unique<RequestSlot>());
+	return slot;
+}
+
 void RPiCamApp::makeRequests()
 {
+	unsigned int slot = 0;
+
+	// Anything still synced from before a restart will be synced again when its new request completes.
+	for (auto &[fb, sync] : buffer_sync_)
+		sync.state = BufferSyncState::Idle;
+
+	for (unsigned int camera = 0; camera < NumCameras(); camera++)
+		makeRequests(camera, slot);
+
+	LOG(2, "Requests created");
+}
+
+void RPiCamApp::makeRequests(unsigned int camera, unsigned int &slot)
+{
+	CameraConfiguration *configuration =
+		camera ? extra_cameras_[camera - 1]->configuration.get() : configuration_.get();
 	std::map<Stream *, std::queue<FrameBuffer *>> free_buffers;
 
-	for (auto &kv : frame_buffers_)
+	for (StreamConfiguration &config : *configuration)
 	{
-		free_buffers[kv.first] = {};
-		for (auto &b : kv.second)
-			free_buffers[kv.first].push(b.get());
+		free_buffers[config.stream()] = {};
+		for (auto &b : frame_buffers_[config.stream()])
+			free_buffers[config.stream()].push(b.get());
 	}
 
 	while (true)
 	{
-		for (StreamConfiguration &config : *configuration_)
+		for (StreamConfiguration &config : *configuration)
 		{
 			Stream *stream = config.stream();
-			if (stream == configuration_->at(0).stream())
+			if (stream == configuration->at(0).stream())
 			{
 				if (free_buffers[stream].empty())
-				{
-					LOG(2, "Requests created");
 					return;
-				}
-				std::unique_ptr<Request> request = camera_->createRequest();
+				slot = freeSlot(slot);
+				std::unique_ptr<Request> request = cameraAt(camera)->createRequest(slot);
 				if (!request)
 					throw std::runtime_error("failed to make request");
+				request_slots_[slot]->request = request.get();
+				request_slots_[slot]->camera = camera;
+				request_slots_[slot++]->buffers.clear();
 				requests_.push_back(std::move(request));
 			}
 			else if (free_buffers[stream].empty())
@@ -1094,17 +1881,201 @@ void RPiCamApp::makeRequests()
 			free_buffers[stream].pop();
 			if (requests_.back()->addBuffer(stream, buffer) < 0)
 				throw std::runtime_error("failed to add buffer to request");
+			request_slots_[requests_.back()->cookie()]->buffers[stream] = buffer;
 		}
 	}
 }
 
+libcamera::Camera *RPiCamApp::cameraAt(unsigned int index) const
+{
+	return index ? extra_cameras_[index - 1]->camera.get() : camera_.get();
+}
+
+void RPiCamApp::adaptRequests(unsigned int in_camera)
+{
+	// Running dry means the camera has to drop frames until something is given back.
+	if (in_camera == 0)
+	{
+		// It's only worth a warning once we can't add any more.
+		unsigned int level = adaptive_count_ < adaptive_max_ ? 2 : 1;
+		starvation_events_++;
+		LOG(level,
+			"Camera ran out of requests with " << adaptive_count_ << " in use (" << starvation_events_ << " times)");
+	}
+
+	// Grow straight away when running low, but only shrink when a whole window shows we have more than we need.
+	adaptive_low_water_ = std::min(adaptive_low_water_, in_camera);
+	if (in_camera <= 1 && adaptive_count_ < adaptive_max_)
+		grow_pending_ = true;
+
+	if (++adaptive_frames_ < ADAPT_WINDOW)
+		return;
+
+	auto now = std::chrono::steady_clock::now();
+	uint64_t interval_ns =
+		std::chrono::duration_cast<std::chrono::nanoseconds>(now - adaptive_window_start_).count() / adaptive_frames_;
+	uint64_t hold_ns = hold_max_ns_.exchange(0, std::memory_order_relaxed);
+	// Enough to cover the longest hold, the pipeline depth and a little slack.
+	unsigned int needed = (interval_ns ? hold_ns / interval_ns : 0) + 3;
+
+	if (needed > adaptive_count_ && adaptive_count_ < adaptive_max_)
+		grow_pending_ = true;
+	else if (adaptive_low_water_ >= 3 && needed < adaptive_count_ && adaptive_count_ > adaptive_min_)
+		retire_pending_ = true;
+
+	adaptive_frames_ = 0;
+	adaptive_low_water_ = UINT_MAX;
+	adaptive_window_start_ = now;
+}
+
+void RPiCamApp::growRequests()
+{
+	// Called from queueRequest(), with camera_stop_mutex_ held. Allocating buffers can be slow, which is why this
+	// isn't done on the camera's completion thread.
+
+	// Slots whose requests are in the camera aren't busy, so look for one without a request. StartCamera() made
+	// enough of these.
+	unsigned int index = 0;
+	while (index < request_slots_.size() &&
+		   (request_slots_[index]->request || request_slots_[index]->busy.load(std::memory_order_acquire)))
+		index++;
+	if (index == request_slots_.size())
+	{
+		LOG_ERROR("No slot for another request");
+		return;
+	}
+	RequestSlot *slot = request_slots_[index].get();
+	std::unique_ptr<Request> request = camera_->createRequest(index);
+	if (!request)
+	{
+		LOG_ERROR("Failed to make another request");
+		return;
+	}
+
+	BufferMap buffers;
+	for (StreamConfiguration &config : *configuration_)
+	{
+		Stream *stream = config.stream();
+		std::vector<std::unique_ptr<FrameBuffer>> &stream_buffers = frame_buffers_[stream];
+		void *mapping;
+		std::unique_ptr<FrameBuffer> buffer =
+			allocBuffer("rpicam-apps" + std::to_string(stream_buffers.size()), config.frameSize, &mapping);
+		if (!buffer)
+		{
+			LOG_ERROR("Failed to allocate another buffer for stream");
+			break;
+		}
+
+		// New buffers behave like the rest of their stream.
+		FrameBuffer *first = stream_buffers.front().get();
+		stream_buffers.push_back(std::move(buffer));
+		FrameBuffer *fb = stream_buffers.back().get();
+		buffers[stream] = fb;
+		{
+			std::unique_lock<std::shared_mutex> maps_lock(buffer_maps_mutex_);
+			mapped_buffers_[fb].policy = mapped_buffers_[first].policy;
+			setMapping(mapped_buffers_[fb], mapping, config.frameSize);
+			buffer_sync_[fb].policy = buffer_sync_[first].policy;
+		}
+
+		if (mapped_buffers_[fb].policy == BufferMapPolicy::Eager && !mapBuffer(fb))
+			break;
+		if (request->addBuffer(stream, fb) < 0)
+			break;
+	}
+
+	if (buffers.size() != configuration_->size())
+	{
+		LOG_ERROR("Failed to add another request");
+		slot->buffers = std::move(buffers);
+		slot->request = nullptr;
+		freeBuffers(slot);
+		return;
+	}
+
+	slot->request = request.get();
+	slot->camera = 0;
+	slot->generation = generation_;
+	slot->buffers = std::move(buffers);
+	requests_.push_back(std::move(request));
+	if (submitRequest(requests_.back().get(), 0) < 0)
+		throw std::runtime_error("failed to queue request");
+
+	adaptive_count_++;
+	LOG(2, "Added a request, now " << adaptive_count_ << " in use");
+}
+
+void RPiCamApp::retireRequest(RequestSlot *slot)
+{
+	// Called from queueRequest(), with camera_stop_mutex_ held.
+	for (auto const &[stream, buffer] : slot->buffers)
+	{
+		BufferSyncState *sync = syncState(buffer);
+		if (sync && sync->state.load(std::memory_order_acquire) == BufferSyncState::Synced)
+		{
+			struct dma_buf_sync dma_sync {};
+			dma_sync.flags = DMA_BUF_SYNC_END | DMA_BUF_SYNC_READ;
+			if (::ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+				LOG_ERROR("failed to sync dma buf on retiring request");
+		}
+	}
+
+	requests_.erase(std::find_if(requests_.begin(), requests_.end(),
+								 [slot](auto const &r) { return r.get() == slot->request; }));
+	slot->request = nullptr;
+	freeBuffers(slot);
+	slot->busy.store(false, std::memory_order_release);
+
+	adaptive_count_--;
+	LOG(2, "Retired a request, now " << adaptive_count_ << " in use");
+}
+
+void RPiCamApp::freeBuffers(RequestSlot *slot)
+{
+	{
+		std::unique_lock<std::shared_mutex> maps_lock(buffer_maps_mutex_);
+		for (auto const &[stream, buffer] : slot->buffers)
+		{
+			auto it = mapped_buffers_.find(buffer);
+			if (it != mapped_buffers_.end())
+			{
+				releaseBuffer(buffer, it->second);
+				mapped_buffers_.erase(it);
+			}
+			buffer_sync_.erase(buffer);
+		}
+	}
+
+	// Previews remember the buffers they've shown by fd, which a new buffer could now re-use.
+	preview_reset_ = true;
+	buffer_generation_++;
+
+	for (auto const &[stream, buffer] : slot->buffers)
+	{
+		std::vector<std::unique_ptr<FrameBuffer>> &stream_buffers = frame_buffers_[const_cast<Stream *>(stream)];
+		stream_buffers.erase(std::find_if(stream_buffers.begin(), stream_buffers.end(),
+										  [buffer = buffer](auto const &b) { return b.get() == buffer; }));
+	}
+	slot->buffers.clear();
+}
+
 void RPiCamApp::requestComplete(Request *request)
 {
+	unsigned int in_camera = 0;
+	if (request_slots_[request->cookie()]->camera == 0)
+	{
+		in_camera = --requests_in_camera_;
+		Watchdog::Leave(Watchdog::Camera);
+		if (auto duration = request->metadata().get(controls::FrameDuration))
+			Watchdog::SetInterval(*duration * 1000);
+	}
+
 	if (request->status() == Request::RequestCancelled)
 	{
 		// If the request is cancelled while the camera is still running, it indicates
-		// a hardware timeout. Let the application handle this error.
-		if (camera_started_)
+		// a hardware timeout. Let the application handle this error, but only tell it
+		// once, as every outstanding request gets cancelled.
+		if (camera_started_ && !timeout_posted_.exchange(true))
 			msg_queue_.Post(Msg(MsgType::Timeout));
 
 		return;
@@ -1114,26 +2085,52 @@ void RPiCamApp::requestComplete(Request *request)
 	dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
 	for (auto const &buffer_map : request->buffers())
 	{
-		auto it = mapped_buffers_.find(buffer_map.second);
-		if (it == mapped_buffers_.end())
+		BufferSyncState *sync = syncState(buffer_map.second);
+		if (!sync)
 			throw std::runtime_error("failed to identify request complete buffer");
 
+		// Other policies leave this to the first BufferReadSync, if there is one.
+		if (sync->policy != BufferSyncPolicy::CpuRead)
+			continue;
+
 		int ret = ::ioctl(buffer_map.second->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync);
 		if (ret)
 			throw std::runtime_error("failed to sync dma buf on request complete");
+		sync->state.store(BufferSyncState::Synced, std::memory_order_release);
 	}
 
-	CompletedRequest *r = new CompletedRequest(sequence_++, request);
-	CompletedRequestPtr payload(r, [this](CompletedRequest *cr) { this->queueRequest(cr); });
+	RequestSlot *slot = request_slots_[request->cookie()].get();
+	slot->complete_time = std::chrono::steady_clock::now();
+	if (slot->camera == 0 && adaptive_max_ > adaptive_min_)
+		adaptRequests(in_camera);
+
+	CompletedRequest *r = &slot->completed;
+	r->Reset(slot->camera ? extra_cameras_[slot->camera - 1]->sequence++ : sequence_++, request);
+	r->camera = slot->camera;
+	if (slot->camera == 0)
 	{
-		std::lock_guard<std::mutex> lock(completed_requests_mutex_);
-		completed_requests_.insert(r);
+		ControlList applied(controls::controls);
+		control_scheduler_.Completed(request->cookie(), r->sequence, r->metadata, applied);
+		if (!applied.empty())
+			r->post_process_metadata.Set("controls.applied", std::move(applied));
 	}
+	slot->generation = generation_;
+	slot->busy.store(true, std::memory_order_release);
+	CompletedRequestPtr payload(r, [this, slot](CompletedRequest *) { this->queueRequest(slot); },
+								RequestSlot::Allocator<CompletedRequest>(slot->arena[slot->uses++ & 1]));
 
 	// Framebuffer reports possibly being in a startup or error state, ignore these.
 	if (r->buffers.begin()->second->metadata().status != libcamera::FrameMetadata::FrameSuccess)
 		return;
 
+	// With several cameras, only complete sets of frames carry on, as the main camera's frame.
+	if (frame_pairer_)
+	{
+		payload = frame_pairer_->Add(payload);
+		if (!payload)
+			return;
+	}
+
 	// We calculate the instantaneous framerate in case anyone wants it.
 	// Use the sensor timestamp if possible as it ought to be less glitchy than
 	// the buffer timestamps.
@@ -1145,9 +2142,67 @@ void RPiCamApp::requestComplete(Request *request)
 		payload->framerate = 1e9 / (timestamp - last_timestamp_);
 	last_timestamp_ = timestamp;
 
+	FrameTrace::Record(FrameTrace::RequestComplete, payload->sequence, timestamp);
 	post_processor_.Process(payload); // post-processor can re-use our shared_ptr
 }
 
+void RPiCamApp::configureFrameSource(std::string const &name)
+{
+	LOG(2, "Configuring " << frame_source_->Name() << " frame source as the " << name << " stream...");
+
+	std::vector<std::unique_ptr<FrameBuffer>> fb;
+	Stream *stream = frame_source_->Configure(fb);
+	for (auto &buffer : fb)
+	{
+		mapped_buffers_[buffer.get()];
+		buffer_sync_[buffer.get()].syncable = frame_source_->Syncable();
+	}
+	frame_buffers_[stream] = std::move(fb);
+	streams_[name] = stream;
+
+	startPreview();
+
+	// Stages can't change the configuration of a frame source, so AdjustConfig() doesn't get called.
+	post_processor_.Configure();
+
+	LOG(2, "Frame source setup complete");
+}
+
+void RPiCamApp::frameReady(FrameBuffer *buffer, ControlList &metadata)
+{
+	RequestSlot *slot = request_slots_[buffer->cookie()].get();
+
+	BufferSyncState *sync = syncState(buffer);
+	if (!sync)
+		throw std::runtime_error("failed to identify frame source buffer");
+	if (sync->syncable && sync->policy == BufferSyncPolicy::CpuRead)
+	{
+		struct dma_buf_sync dma_sync {};
+		dma_sync.flags = DMA_BUF_SYNC_START | DMA_BUF_SYNC_READ;
+		if (::ioctl(buffer->planes()[0].fd.get(), DMA_BUF_IOCTL_SYNC, &dma_sync))
+			throw std::runtime_error("failed to sync dma buf on frame ready");
+		sync->state.store(BufferSyncState::Synced, std::memory_order_release);
+	}
+
+	CompletedRequest *r = &slot->completed;
+	r->Reset(sequence_++, slot->buffers, metadata);
+	slot->generation = generation_;
+	slot->busy.store(true, std::memory_order_release);
+	CompletedRequestPtr payload(r, [this, slot](CompletedRequest *) { this->queueRequest(slot); },
+								RequestSlot::Allocator<CompletedRequest>(slot->arena[slot->uses++ & 1]));
+
+	// Frame sources always stamp their frames with a SensorTimestamp.
+	uint64_t timestamp = payload->metadata.get(controls::SensorTimestamp).value_or(0);
+	if (last_timestamp_ == 0 || last_timestamp_ == timestamp)
+		payload->framerate = 0;
+	else
+		payload->framerate = 1e9 / (timestamp - last_timestamp_);
+	last_timestamp_ = timestamp;
+
+	FrameTrace::Record(FrameTrace::RequestComplete, payload->sequence, timestamp);
+	post_processor_.Process(payload);
+}
+
 void RPiCamApp::previewDoneCallback(int fd)
 {
 	std::lock_guard<std::mutex> lock(preview_mutex_);
@@ -1180,6 +2235,8 @@ void RPiCamApp::stopPreview()
 
 void RPiCamApp::previewThread()
 {
+	ThreadPolicy::Apply("preview");
+
 	while (true)
 	{
 		PreviewItem item;
@@ -1209,6 +2266,7 @@ void RPiCamApp::previewThread()
 		FrameInfo frame_info(item.completed_request);
 
 		int fd = buffer->planes()[0].fd.get();
+		unsigned int sequence = item.completed_request->sequence;
 		{
 			std::lock_guard<std::mutex> lock(preview_mutex_);
 			// the reference to the shared_ptr moves to the map here
@@ -1220,6 +2278,9 @@ void RPiCamApp::previewThread()
 			msg_queue_.Post(Msg(MsgType::Quit));
 		}
 		preview_frames_displayed_++;
+		FrameTrace::Record(FrameTrace::PreviewShow, sequence);
+		if (preview_reset_.exchange(false))
+			preview_->Reset();
 		preview_->Show(fd, span, info);
 		if (!options_->Get().info_text.empty())
 		{
@@ -9,12 +9,19 @@
 
 #include <sys/mman.h>
 
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <climits>
 #include <condition_variable>
+#include <cstddef>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
+#include <shared_mutex>
 #include <sstream>
 #include <string>
 #include <thread>
@@ -32,9 +39,14 @@
 
 #include "core/buffer_sync.hpp"
 #include "core/completed_request.hpp"
+#include "core/control_scheduler.hpp"
 #include "core/dma_heaps.hpp"
+#include "core/frame_pairer.hpp"
+#include "core/frame_source.hpp"
+#include "core/frame_trace.hpp"
 #include "core/post_processor.hpp"
 #include "core/stream_info.hpp"
+#include "core/watchdog.hpp"
 
 struct Options;
 class Preview;
@@ -60,13 +72,33 @@ public:
 	using BufferMap = Request::BufferMap;
 	using Size = libcamera::Size;
 	using Rectangle = libcamera::Rectangle;
+	// How the CPU caches are maintained for a stream's buffers while a completed request is out with the
+	// application. CpuRead syncs every buffer for reading when the request completes. Lazy leaves it to the
+	// first BufferReadSync on the buffer, so a stream that is never mapped costs nothing. DeviceOnly is for
+	// streams that are only passed on by fd; it is as Lazy, but complains if the CPU does read the buffer.
+	enum class BufferSyncPolicy
+	{
+		CpuRead,
+		Lazy,
+		DeviceOnly
+	};
+	// When a stream's buffers are mapped into our address space. Eager maps them all before the camera
+	// starts, Lazy maps each one when a BufferReadSync or BufferWriteSync first needs it, and Never is for
+	// streams that are only ever passed on by fd.
+	enum class BufferMapPolicy
+	{
+		Eager,
+		Lazy,
+		Never
+	};
 	enum class MsgType
 	{
 		RequestComplete,
 		Timeout,
-		Quit
+		Quit,
+		Diagnostic // a Watchdog::Stall, for information only
 	};
-	typedef std::variant<CompletedRequestPtr> MsgPayload;
+	typedef std::variant<CompletedRequestPtr, Watchdog::Stall> MsgPayload;
 	struct Msg
 	{
 		Msg(MsgType const &t) : type(t) {}
@@ -130,8 +162,11 @@ public:
 
 	Options *GetOptions() const { return options_.get(); }
 
+	// With a frame source, both of these give its name.
 	std::string const &CameraId() const;
 	std::string CameraModel() const;
+	// The main camera, plus any --extra-cameras.
+	unsigned int NumCameras() const { return 1 + extra_cameras_.size(); }
 	void OpenCamera();
 	void CloseCamera();
 
@@ -143,8 +178,15 @@ public:
 	void Teardown();
 	void StartCamera();
 	void StopCamera();
+	// Stop and start the camera again, for example after a timeout, keeping the same requests,
+	// buffers and initial controls, and without disturbing the post-processor or preview.
+	void RestartCamera();
 
 	Msg Wait();
+	// Return a message only if one is ready, so that the application can drain several at once.
+	std::optional<Msg> TryWait();
+	// As Wait(), but give up and return nothing at the deadline.
+	std::optional<Msg> WaitFor(std::chrono::steady_clock::time_point deadline);
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -154,6 +196,8 @@ public:
 	Stream *VideoStream(StreamInfo *info = nullptr) const;
 	Stream *LoresStream(StreamInfo *info = nullptr) const;
 	Stream *GetMainStream() const;
+	// The stream on another camera that matches one of the main camera's streams. Camera 0 is the main one.
+	Stream *CameraStream(unsigned int camera, Stream const *stream) const;
 
 	const CameraManager *GetCameraManager();
 	std::vector<std::shared_ptr<libcamera::Camera>> GetCameras()
@@ -164,10 +208,28 @@ public:
 	void ShowPreview(CompletedRequestPtr &completed_request, Stream *stream);
 
 	void SetControls(const ControlList &controls);
+	// Set controls to take effect on the frame with the given sequence number, allowing for the frames that each
+	// control takes to come through, or as soon as possible if that frame is too close. Every frame lists the
+	// controls that took effect on it as a ControlList in its post_process_metadata, under "controls.applied".
+	void SetControls(const ControlList &controls, unsigned int sequence);
+	// Set the cache maintenance policy for a stream's buffers. Post-processing stages would normally call
+	// this from their Configure() method. The policy reverts to CpuRead when the camera is torn down.
+	void SetBufferSyncPolicy(Stream const *stream, BufferSyncPolicy policy);
+	// Likewise set when a stream's buffers get mapped. The policy reverts to Eager when the camera is torn down.
+	// Neither may be called while the camera is running.
+	void SetBufferMapPolicy(Stream const *stream, BufferMapPolicy policy);
 	StreamInfo GetStreamInfo(Stream const *stream) const;
+	// Goes up whenever buffers are freed while the camera is configured, so that anything remembering buffers
+	// (by FrameBuffer pointer or fd) knows that one of them may now be a different buffer.
+	uint64_t BufferGeneration() const { return buffer_generation_; }
+	// The fewest requests the camera runs with in the current configuration. A stage that holds on to requests
+	// must keep well below this, or the camera will run out.
+	unsigned int MinRequests() const { return adaptive_min_; }
+	// A frame source has no camera properties, so they're empty.
 	const ControlList &GetProperties() const
 	{
-		return camera_->properties();
+		static const ControlList none;
+		return frame_source_ ? none : camera_->properties();
 	}
 
 	static unsigned int verbosity;
@@ -193,35 +255,37 @@ protected:
 	std::unique_ptr<Options> options_;
 
 private:
-	template <typename T>
+	// A bounded lock-free queue of messages for the application's event loop. Any thread may post, but only
+	// the application thread takes messages out. A waiting consumer is woken through an eventfd, which is
+	// only signalled when the consumer is actually asleep.
 	class MessageQueue
 	{
 	public:
-		template <typename U>
-		void Post(U &&msg)
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
-		}
-		T Wait()
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			cond_.wait(lock, [this] { return !queue_.empty(); });
-			T msg = std::move(queue_.front());
-			queue_.pop();
-			return msg;
-		}
-		void Clear()
-		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_ = {};
-		}
+		MessageQueue();
+		~MessageQueue();
+		void Post(Msg &&msg);
+		Msg Wait();
+		std::optional<Msg> TryWait();
+		std::optional<Msg> WaitFor(std::chrono::steady_clock::time_point deadline);
+		void Clear();
 
 	private:
-		std::queue<T> queue_;
-		std::mutex mutex_;
-		std::condition_variable cond_;
+		static constexpr unsigned int CAPACITY = 256;
+		struct Cell
+		{
+			std::atomic<uint64_t> sequence;
+			std::optional<Msg> msg;
+		};
+		std::optional<Msg> wait(bool forever, std::chrono::steady_clock::time_point deadline);
+		std::array<Cell, CAPACITY> cells_;
+		alignas(64) std::atomic<uint64_t> tail_ { 0 };
+		alignas(64) uint64_t head_ = 0;
+		std::atomic<bool> sleeping_ { false };
+		int event_fd_;
+		// For producers waiting for the consumer to make room.
+		std::atomic<unsigned int> full_waiters_ { 0 };
+		std::mutex full_mutex_;
+		std::condition_variable full_cv_;
 	};
 	struct PreviewItem
 	{
@@ -237,12 +301,83 @@ private:
 		CompletedRequestPtr completed_request;
 		Stream *stream;
 	};
+	// Every Request gets a preallocated slot, whose index is the request cookie. The slot's CompletedRequest
+	// is recycled for every frame and the shared_ptr's control block (which holds the reference count) is
+	// constructed in the slot, so completing a request needs no heap allocation and no lock. Slots are only
+	// freed with the application, because it may still be holding a CompletedRequest when the camera is
+	// re-configured.
+	struct RequestSlot
+	{
+		static constexpr unsigned int ARENA_SIZE = 128;
+		template <typename T>
+		struct Allocator
+		{
+			using value_type = T;
+			Allocator(uint8_t *a) : arena(a) {}
+			template <typename U>
+			Allocator(Allocator<U> const &other) : arena(other.arena) {}
+			T *allocate(std::size_t n)
+			{
+				if (n * sizeof(T) > ARENA_SIZE)
+					throw std::bad_alloc();
+				return reinterpret_cast<T *>(arena);
+			}
+			void deallocate(T *, std::size_t) {}
+			bool operator==(Allocator const &other) const { return arena == other.arena; }
+			bool operator!=(Allocator const &other) const { return arena != other.arena; }
+			uint8_t *arena;
+		};
+		CompletedRequest completed;
+		// The previous control block is only destroyed just after its deleter has re-queued the
+		// request, so alternate between two arenas.
+		alignas(std::max_align_t) uint8_t arena[2][ARENA_SIZE];
+		unsigned int uses = 0;
+		uint32_t generation = 0; // camera generation of the completed request
+		Request *request = nullptr;
+		unsigned int camera = 0; // the camera that the request belongs to
+		std::chrono::steady_clock::time_point complete_time; // when the request last completed
+		BufferMap buffers; // the buffers that belong to the request
+		std::atomic<bool> busy { false }; // the completed request is still referenced
+	};
+
+	struct MappedBuffer
+	{
+		BufferMapPolicy policy = BufferMapPolicy::Eager;
+		std::atomic<bool> mapped { false };
+		std::vector<libcamera::Span<uint8_t>> planes;
+	};
 
 	void initCameraManager();
-	void setupCapture();
+	struct ExtraCamera
+	{
+		std::shared_ptr<Camera> camera;
+		bool acquired = false;
+		std::unique_ptr<CameraConfiguration> configuration;
+		unsigned int sequence = 0;
+	};
+
+	struct BufferSyncState;
+
+	void setupCapture(StreamRoles const &stream_roles);
 	void makeRequests();
-	void queueRequest(CompletedRequest *completed_request);
+	void makeRequests(unsigned int camera, unsigned int &slot);
+	Camera *cameraAt(unsigned int index) const;
+	MappedBuffer *mapBuffer(FrameBuffer *fb);
+	BufferSyncState *syncState(FrameBuffer *fb);
+	void adaptRequests(unsigned int in_camera);
+	void growRequests();
+	void retireRequest(RequestSlot *slot);
+	void startWatchdog(uint64_t interval_ns);
+	void freeBuffers(RequestSlot *slot);
+	std::unique_ptr<FrameBuffer> allocBuffer(std::string const &name, std::size_t size, void **mapping);
+	void setMapping(MappedBuffer &mapped, void *mapping, std::size_t size);
+	void releaseBuffer(FrameBuffer *fb, MappedBuffer &mapped);
+	unsigned int freeSlot(unsigned int first);
+	void queueRequest(RequestSlot *slot);
+	int submitRequest(Request *request, unsigned int camera);
 	void requestComplete(Request *request);
+	void configureFrameSource(std::string const &name);
+	void frameReady(FrameBuffer *buffer, ControlList &metadata);
 	void previewDoneCallback(int fd);
 	void startPreview();
 	void stopPreview();
@@ -253,17 +388,42 @@ private:
 	std::unique_ptr<CameraManager> camera_manager_;
 	std::shared_ptr<Camera> camera_;
 	bool camera_acquired_ = false;
+	std::unique_ptr<FrameSource> frame_source_; // stands in for camera_ when set
+	std::string frame_source_name_;
+	// Further cameras that run alongside camera_, sharing its configuration, post-processor and preview.
+	std::vector<std::unique_ptr<ExtraCamera>> extra_cameras_;
+	std::unique_ptr<FramePairer> frame_pairer_;
 	std::unique_ptr<CameraConfiguration> configuration_;
-	std::map<FrameBuffer *, std::vector<libcamera::Span<uint8_t>>> mapped_buffers_;
+	// Every buffer has an entry from when it's allocated. Entries are only added or removed while streaming
+	// when the number of requests adapts, and then under buffer_maps_mutex_. The entries get mapped under
+	// mapping_mutex_.
+	std::map<FrameBuffer *, MappedBuffer> mapped_buffers_;
+	std::mutex mapping_mutex_;
+	std::shared_mutex buffer_maps_mutex_;
+	struct BufferSyncState
+	{
+		enum State
+		{
+			Idle,
+			Syncing,
+			Synced
+		};
+		BufferSyncPolicy policy = BufferSyncPolicy::CpuRead;
+		std::atomic<int> state { Idle }; // whether the buffer has been synced for the CPU this frame
+		std::atomic<bool> warned { false };
+		bool syncable = true; // false for frame source buffers that aren't dmabufs
+	};
+	std::map<FrameBuffer *, BufferSyncState> buffer_sync_;
 	std::map<std::string, Stream *> streams_;
 	DmaHeap dma_heap_;
 	std::map<Stream *, std::vector<std::unique_ptr<FrameBuffer>>> frame_buffers_;
 	std::vector<std::unique_ptr<Request>> requests_;
-	std::mutex completed_requests_mutex_;
-	std::set<CompletedRequest *> completed_requests_;
+	std::vector<std::unique_ptr<RequestSlot>> request_slots_;
+	uint32_t generation_ = 0; // bumped whenever the camera stops, so stale slots are not re-queued
 	bool camera_started_ = false;
+	std::atomic<bool> timeout_posted_ { false };
 	std::mutex camera_stop_mutex_;
-	MessageQueue<Msg> msg_queue_;
+	MessageQueue msg_queue_;
 	std::vector<SensorMode> sensor_modes_;
 	// Related to the preview window.
 	std::unique_ptr<Preview> preview_;
@@ -273,15 +433,33 @@ private:
 	PreviewItem preview_item_;
 	std::condition_variable preview_cond_var_;
 	bool preview_abort_ = false;
+	std::atomic<bool> preview_reset_ { false }; // buffers have been freed, so forget what was shown
+	std::atomic<uint64_t> buffer_generation_ { 0 };
 	uint32_t preview_frames_displayed_ = 0;
 	uint32_t preview_frames_dropped_ = 0;
 	std::thread preview_thread_;
 	// For setting camera controls.
 	std::mutex control_mutex_;
 	ControlList controls_;
+	ControlList initial_controls_;
+	ControlScheduler control_scheduler_;
+	std::atomic<unsigned int> requests_in_camera_ { 0 }; // main camera requests queued and not yet completed
+	uint64_t next_sequence_ = 0; // what the next main camera request queued will complete as, under camera_stop_mutex_
+	// The number of main camera requests adapts between these when --buffer-count-max is given.
+	static constexpr unsigned int ADAPT_WINDOW = 60; // frames between decisions to shrink
+	unsigned int adaptive_min_ = 0;
+	unsigned int adaptive_max_ = 0;
+	std::atomic<unsigned int> adaptive_count_ { 0 };
+	unsigned int adaptive_frames_ = 0;
+	unsigned int adaptive_low_water_ = UINT_MAX; // fewest requests left in the camera this window
+	std::chrono::steady_clock::time_point adaptive_window_start_;
+	std::atomic<uint64_t> hold_max_ns_ { 0 }; // longest time a request spent out of the camera this window
+	std::atomic<bool> retire_pending_ { false };
+	std::atomic<bool> grow_pending_ { false };
+	uint64_t starvation_events_ = 0;
 	// Other:
 	uint64_t last_timestamp_;
-	uint64_t sequence_ = 0;
+	std::atomic<uint64_t> sequence_ { 0 };
 	PostProcessor post_processor_;
 	libcamera::PixelFormat lores_format_ = libcamera::formats::YUV420;
 };
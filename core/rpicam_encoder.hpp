@@ -71,6 +71,8 @@ public:
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
 			encode_buffer_queue_.push(completed_request); // creates a new reference
 		}
+		FrameTrace::Record(FrameTrace::EncodeSubmit, completed_request->sequence, timestamp_ns / 1000);
+		Watchdog::Enter(Watchdog::Encoder);
 		encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 
 		// Tell our caller that encoding is underway.
@@ -103,6 +105,8 @@ private:
 			if (encode_buffer_queue_.empty())
 				throw std::runtime_error("no buffer available to return");
 			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
+			FrameTrace::Record(FrameTrace::EncodeDone, completed_request->sequence);
+			Watchdog::Leave(Watchdog::Encoder);
 			if (metadata_ready_callback_ && !GetOptions()->Get().metadata.empty())
 				metadata_ready_callback_(completed_request->metadata);
 			encode_buffer_queue_.pop(); // drop shared_ptr reference
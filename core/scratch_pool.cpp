@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * scratch_pool.cpp - Re-usable frame-sized scratch buffers.
+ */
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <stdexcept>
+
+#include "core/logging.hpp"
+#include "core/scratch_pool.hpp"
+
+static constexpr std::size_t HUGE_PAGE_SIZE = 2 << 20;
+
+ScratchPool &ScratchPool::Get()
+{
+	static ScratchPool pool;
+	return pool;
+}
+
+ScratchPool::~ScratchPool()
+{
+	for (auto const &[size, ptr] : idle_)
+		munmap(ptr, size);
+}
+
+void ScratchPool::Configure(std::size_t limit, bool huge_pages)
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	limit_ = limit;
+	huge_pages_ = huge_pages;
+
+	while (idle_bytes_ > limit_)
+	{
+		auto it = std::prev(idle_.end());
+		idle_bytes_ -= it->first;
+		munmap(it->second, it->first);
+		idle_.erase(it);
+	}
+}
+
+void ScratchPool::LogStats() const
+{
+	std::lock_guard<std::mutex> lock(mutex_);
+	LOG(2, "Scratch pool: " << reused_ << " reused, " << mapped_ << " mapped, " << idle_.size() << " idle ("
+							<< idle_bytes_ / 1024 << "kB)");
+}
+
+std::shared_ptr<void> ScratchPool::allocate(std::size_t size)
+{
+	std::unique_lock<std::mutex> lock(mutex_);
+
+	// Rounding to whole (huge) pages lets buffers of near enough the same size share.
+	std::size_t page_size = huge_pages_ && size >= HUGE_PAGE_SIZE ? HUGE_PAGE_SIZE : sysconf(_SC_PAGESIZE);
+	size = (size + page_size - 1) & ~(page_size - 1);
+
+	void *ptr = nullptr;
+	auto it = idle_.lower_bound(size);
+	if (it != idle_.end() && it->first - size <= size / 4)
+	{
+		size = it->first;
+		ptr = it->second;
+		idle_bytes_ -= size;
+		idle_.erase(it);
+		reused_++;
+	}
+	else
+	{
+		bool huge_pages = page_size == HUGE_PAGE_SIZE;
+		mapped_++;
+		lock.unlock();
+
+		ptr = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (ptr == MAP_FAILED)
+			throw std::runtime_error("failed to map scratch buffer: " + std::string(strerror(errno)));
+		if (huge_pages && madvise(ptr, size, MADV_HUGEPAGE))
+			LOG(2, "Scratch buffer can't use huge pages: " << strerror(errno));
+	}
+
+	return std::shared_ptr<void>(ptr, [this, size](void *p) { release(p, size); });
+}
+
+void ScratchPool::release(void *ptr, std::size_t size)
+{
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		if (idle_bytes_ + size <= limit_)
+		{
+			idle_.emplace(size, ptr);
+			idle_bytes_ += size;
+			return;
+		}
+	}
+
+	munmap(ptr, size);
+}
@@ -0,0 +1,51 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * scratch_pool.hpp - Re-usable frame-sized scratch buffers.
+ */
+
+#pragma once
+
+#include <cstddef>
+#include <map>
+#include <memory>
+#include <mutex>
+
+// Hands out large scratch buffers and takes them back when the last reference goes, so that code which needs
+// a frame-sized buffer every frame or capture gets the same memory back rather than faulting in new pages each
+// time. Buffers come straight from mmap, so they're page aligned, and those of 2MB or more can be backed by
+// transparent huge pages. Their contents are undefined unless the buffer is new.
+
+class ScratchPool
+{
+public:
+	static ScratchPool &Get();
+
+	// Keep up to limit bytes of idle buffers.
+	void Configure(std::size_t limit, bool huge_pages);
+
+	template <typename T>
+	std::shared_ptr<T> Allocate(std::size_t count)
+	{
+		std::shared_ptr<void> block = allocate(count * sizeof(T));
+		return std::shared_ptr<T>(block, static_cast<T *>(block.get()));
+	}
+
+	void LogStats() const;
+
+private:
+	ScratchPool() = default;
+	~ScratchPool();
+
+	std::shared_ptr<void> allocate(std::size_t size);
+	void release(void *ptr, std::size_t size);
+
+	mutable std::mutex mutex_;
+	std::multimap<std::size_t, void *> idle_; // by size
+	std::size_t limit_ = 64 << 20;
+	bool huge_pages_ = false;
+	std::size_t idle_bytes_ = 0;
+	unsigned int reused_ = 0;
+	unsigned int mapped_ = 0;
+};
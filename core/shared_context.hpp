@@ -0,0 +1,264 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * shared_context.hpp - Frame descriptors shared with other processes.
+ */
+
+#pragma once
+
+#include <signal.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+
+#include "core/stream_info.hpp"
+
+// The sharedContext stage publishes a descriptor for every frame into a ring of slots in SysV
+// shared memory. Each slot is guarded by a sequence lock: the writer makes the count odd while it
+// fills the slot in and even again when it's done, so a reader that sees the same even count before
+// and after copying a slot knows the copy isn't torn. The writer never waits for readers. A reader
+// that falls more than NUM_SLOTS frames behind loses the oldest ones, and can tell how many from the
+// write index. The buffers themselves are handed out by an FdBroker listening on socket_path, and
+// frames only refer to them by index. Rather than polling write_index, a reader can subscribe
+// through the broker to have an eventfd signalled as frames are published.
+//
+// Any number of readers, up to SharedConsumers::MAX_CONSUMERS, can come and go while the writer
+// runs. Each one attaches to claim an entry in the consumer registry, which holds its own cursor (the
+// next frame it wants) and the streams whose buffers it uses, and detaches to give it back. The
+// writer keeps each consumer's lag statistics up to date, and frees the entries of processes that
+// have died. The segment is left in place when the writer exits, so that readers can stay attached
+// while it restarts.
+//
+// The writer can also lend frames to readers, holding on to each frame's buffers (rather than
+// giving them back to the camera) until every attached reader that uses buffers has moved its cursor
+// past it. There are never more than max_leases frames on loan, and a loan that runs out of time is
+// taken back anyway, so that a reader that stops can't starve the camera. Bump VERSION whenever the
+// layout changes.
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free && std::atomic<uint32_t>::is_always_lock_free,
+			  "shared context must be lock-free to be shared between processes");
+
+struct SharedMetadata
+{
+	float exposure_time;
+	float analogue_gain;
+	float digital_gain;
+	unsigned int colorTemp;
+	int64_t ts;
+	float colour_gains[2];
+	float focus;
+	float fps;
+	float lens_position;
+	int af_state;
+};
+
+struct SharedFrame
+{
+	uint64_t index; // position in the ring's sequence of frames, counting from 0
+	uint32_t generation; // the fd broker generation that the buffer indices belong to
+	// Buffers are given by their index among those the fd broker has sent, or -1 if there isn't one.
+	int raw_buffer;
+	int isp_buffer;
+	int lores_buffer;
+	size_t raw_length;
+	size_t isp_length;
+	size_t lores_length;
+	uint64_t ts; // wall clock time (ms) at which the frame was published
+	SharedMetadata metadata;
+	unsigned int sequence;
+	float framerate;
+	uint32_t stats_length;
+	uint8_t stats[23200];
+};
+
+struct SharedConsumer
+{
+	enum State
+	{
+		Free,
+		Claimed, // being filled in by the reader that is attaching
+		Attached
+	};
+
+	std::atomic<uint32_t> state;
+	int32_t pid;
+	uint32_t streams; // bit mask of (1 << SharedContext::Stream) for the buffers it uses, 0 for metadata only
+	char name[32];
+	std::atomic<uint64_t> cursor; // the consumer has finished with every frame before this one
+	std::atomic<uint64_t> missed; // frames overwritten before the consumer got to them
+	std::atomic<uint64_t> lag; // frames published that the consumer hadn't finished with, at the last publish
+	std::atomic<uint64_t> max_lag;
+};
+
+// The consumer registry, shared by the CINE context and the CAIM stream info.
+struct SharedConsumers
+{
+	static constexpr unsigned int MAX_CONSUMERS = 8;
+
+	SharedConsumer consumers[MAX_CONSUMERS];
+
+	// Reader side. Claim a consumer entry, returning its id or -1 if there are none left. The cursor
+	// starts at the given frame, normally the next one to be published.
+	int Attach(char const *name, uint32_t streams, uint64_t start)
+	{
+		for (unsigned int id = 0; id < MAX_CONSUMERS; id++)
+		{
+			SharedConsumer &c = consumers[id];
+			uint32_t state = SharedConsumer::Free;
+			if (!c.state.compare_exchange_strong(state, SharedConsumer::Claimed, std::memory_order_acquire))
+				continue;
+			c.pid = getpid();
+			c.streams = streams;
+			std::strncpy(c.name, name, sizeof(c.name) - 1);
+			c.name[sizeof(c.name) - 1] = 0;
+			c.cursor.store(start, std::memory_order_relaxed);
+			c.missed.store(0, std::memory_order_relaxed);
+			c.lag.store(0, std::memory_order_relaxed);
+			c.max_lag.store(0, std::memory_order_relaxed);
+			c.state.store(SharedConsumer::Attached, std::memory_order_release);
+			return id;
+		}
+		return -1;
+	}
+
+	void Detach(int id) { consumers[id].state.store(SharedConsumer::Free, std::memory_order_release); }
+
+	// Reader side. Give back every frame up to and including this one.
+	void Release(int id, uint64_t index) { consumers[id].cursor.store(index + 1, std::memory_order_release); }
+
+	// Writer side. Update everyone's lag once write_index frames have been published, and return the
+	// oldest frame that a consumer using buffers hasn't finished with (write_index if there isn't one).
+	uint64_t Update(uint64_t write_index)
+	{
+		uint64_t released = write_index;
+		for (SharedConsumer &c : consumers)
+		{
+			if (c.state.load(std::memory_order_acquire) != SharedConsumer::Attached)
+				continue;
+			uint64_t cursor = c.cursor.load(std::memory_order_acquire);
+			uint64_t lag = write_index > cursor ? write_index - cursor : 0;
+			c.lag.store(lag, std::memory_order_relaxed);
+			if (lag > c.max_lag.load(std::memory_order_relaxed))
+				c.max_lag.store(lag, std::memory_order_relaxed);
+			if (c.streams)
+				released = std::min(released, cursor);
+		}
+		return released;
+	}
+
+	// Writer side. Free the entries of consumers that exited without detaching, returning how many.
+	unsigned int Reap()
+	{
+		unsigned int reaped = 0;
+		for (SharedConsumer &c : consumers)
+		{
+			uint32_t state = SharedConsumer::Attached;
+			if (c.state.load(std::memory_order_acquire) == state && kill(c.pid, 0) < 0 && errno == ESRCH &&
+				c.state.compare_exchange_strong(state, SharedConsumer::Free, std::memory_order_acq_rel))
+				reaped++;
+		}
+		return reaped;
+	}
+
+	// Writer side, when starting afresh.
+	void Clear()
+	{
+		for (SharedConsumer &c : consumers)
+			c.state.store(SharedConsumer::Free, std::memory_order_relaxed);
+	}
+};
+
+struct SharedSlot
+{
+	std::atomic<uint32_t> seq; // odd while the slot is being written
+	SharedFrame frame;
+};
+
+struct SharedContext
+{
+	static constexpr uint32_t MAGIC = 0x43494E45; // "CINE"
+	static constexpr uint32_t VERSION = 4;
+	static constexpr unsigned int NUM_SLOTS = 8;
+	// How the fd broker labels the buffers of each stream.
+	enum Stream
+	{
+		RawStream,
+		IspStream,
+		LoresStream
+	};
+
+	uint32_t magic;
+	uint32_t version;
+	uint32_t num_slots;
+	int procid;
+	uint64_t ts; // wall clock time (ms) at which the writer attached
+	StreamInfo raw;
+	StreamInfo isp;
+	StreamInfo lores;
+	char socket_path[108]; // where to connect to the fd broker for the buffers
+	std::atomic<uint32_t> broker_generation; // buffer indices only mean anything within the same generation
+	uint32_t max_leases; // frames the writer will hold on to for readers, or 0 if it won't
+	uint32_t lease_timeout_ms;
+	std::atomic<uint64_t> write_index; // frames published so far
+	std::atomic<uint64_t> leases_expired; // frames taken back before the readers released them
+	SharedConsumers consumers;
+	SharedSlot slots[NUM_SLOTS];
+
+	// Writer side. Call Begin() to get the slot for the next frame, fill it in, then Publish().
+	SharedFrame &Begin()
+	{
+		uint64_t index = write_index.load(std::memory_order_relaxed);
+		SharedSlot &slot = slots[index % NUM_SLOTS];
+		slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_relaxed);
+		std::atomic_thread_fence(std::memory_order_release);
+		slot.frame.index = index;
+		return slot.frame;
+	}
+
+	void Publish()
+	{
+		uint64_t index = write_index.load(std::memory_order_relaxed);
+		SharedSlot &slot = slots[index % NUM_SLOTS];
+		slot.seq.store(slot.seq.load(std::memory_order_relaxed) + 1, std::memory_order_release);
+		write_index.store(index + 1, std::memory_order_release);
+	}
+
+	// Reader side. Copies out the frame with the given index, returning false if it isn't there
+	// (not yet written, or already overwritten) or was being rewritten while we copied it.
+	bool Read(uint64_t index, SharedFrame &frame) const
+	{
+		SharedSlot const &slot = slots[index % NUM_SLOTS];
+		uint32_t seq = slot.seq.load(std::memory_order_acquire);
+		if (seq & 1)
+			return false;
+		std::memcpy(&frame, &slot.frame, sizeof(frame));
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return slot.seq.load(std::memory_order_relaxed) == seq && frame.index == index;
+	}
+
+	// Reader side. Returns the next frame the consumer should read, first moving its cursor past any
+	// frames that were overwritten before it got to them.
+	uint64_t Next(int id)
+	{
+		SharedConsumer &c = consumers.consumers[id];
+		uint64_t cursor = c.cursor.load(std::memory_order_relaxed);
+		uint64_t oldest = Oldest();
+		if (cursor >= oldest)
+			return cursor;
+		c.missed.fetch_add(oldest - cursor, std::memory_order_relaxed);
+		c.cursor.store(oldest, std::memory_order_release);
+		return oldest;
+	}
+
+	// The oldest frame that a reader might still find in the ring.
+	uint64_t Oldest() const
+	{
+		uint64_t index = write_index.load(std::memory_order_acquire);
+		return index > NUM_SLOTS ? index - NUM_SLOTS : 0;
+	}
+};
@@ -0,0 +1,205 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_policy.cpp - Per-role thread naming, CPU affinity and scheduling.
+ */
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <cstring>
+#include <map>
+#include <mutex>
+#include <optional>
+#include <sstream>
+#include <stdexcept>
+#include <vector>
+
+#include <boost/algorithm/string.hpp>
+#include <boost/property_tree/json_parser.hpp>
+#include <boost/property_tree/ptree.hpp>
+
+#include "core/logging.hpp"
+#include "core/thread_policy.hpp"
+
+namespace
+{
+
+struct Policy
+{
+	std::vector<unsigned int> cpus;
+	std::optional<int> fifo;
+	std::optional<int> nice;
+};
+
+// Only written before any threads that use it are started.
+std::map<std::string, Policy> policies;
+std::mutex warned_mutex;
+bool warned = false;
+
+std::vector<unsigned int> parse_cpus(std::string const &cpus)
+{
+	std::vector<std::string> ranges;
+	boost::algorithm::split(ranges, cpus, boost::algorithm::is_any_of("+"));
+
+	std::vector<unsigned int> result;
+	unsigned int num_cpus = sysconf(_SC_NPROCESSORS_CONF);
+	for (auto const &range : ranges)
+	{
+		unsigned int first, last;
+		char dash;
+		std::istringstream s(range);
+		if (!(s >> first))
+			throw std::runtime_error("bad CPU list \"" + cpus + "\" in thread policy");
+		last = first;
+		if (s >> dash && (dash != '-' || !(s >> last)))
+			throw std::runtime_error("bad CPU list \"" + cpus + "\" in thread policy");
+		if (last < first || last >= num_cpus)
+			throw std::runtime_error("CPUs \"" + range + "\" in thread policy don't exist");
+		for (unsigned int cpu = first; cpu <= last; cpu++)
+			result.push_back(cpu);
+	}
+
+	return result;
+}
+
+std::string describe(Policy const &policy)
+{
+	std::ostringstream s;
+	if (!policy.cpus.empty())
+	{
+		s << "cpus";
+		for (unsigned int cpu : policy.cpus)
+			s << " " << cpu;
+	}
+	if (policy.fifo)
+		s << (s.tellp() ? ", " : "") << "fifo " << *policy.fifo;
+	if (policy.nice)
+		s << (s.tellp() ? ", " : "") << "nice " << *policy.nice;
+	return s.str();
+}
+
+void warn(std::string const &what, char const *name)
+{
+	// Typically this is for want of permission, which is the same for every thread, so only say once.
+	std::lock_guard<std::mutex> lock(warned_mutex);
+	if (!warned)
+		LOG_ERROR("WARNING: unable to " << what << " for thread " << name << ": " << strerror(errno));
+	warned = true;
+}
+
+} // namespace
+
+void ThreadPolicy::Configure(std::string const &policy)
+{
+	policies.clear();
+	if (policy.empty())
+		return;
+
+	if (boost::algorithm::ends_with(policy, ".json"))
+	{
+		boost::property_tree::ptree root;
+		boost::property_tree::read_json(policy, root);
+		for (auto const &[role, node] : root)
+		{
+			Policy &p = policies[role];
+			if (auto cpus = node.get_optional<std::string>("cpus"))
+				p.cpus = parse_cpus(*cpus);
+			if (auto fifo = node.get_optional<int>("fifo"))
+				p.fifo = *fifo;
+			if (auto nice = node.get_optional<int>("nice"))
+				p.nice = *nice;
+		}
+	}
+	else
+	{
+		std::vector<std::string> roles;
+		boost::algorithm::split(roles, policy, boost::algorithm::is_any_of(","));
+		for (auto const &role : roles)
+		{
+			std::vector<std::string> settings;
+			boost::algorithm::split(settings, role, boost::algorithm::is_any_of(":"));
+			Policy &p = policies[settings[0]];
+			for (unsigned int i = 1; i < settings.size(); i++)
+			{
+				std::string::size_type eq = settings[i].find('=');
+				std::string key = settings[i].substr(0, eq);
+				std::string value = eq == std::string::npos ? "" : settings[i].substr(eq + 1);
+				try
+				{
+					if (key == "cpus")
+						p.cpus = parse_cpus(value);
+					else if (key == "fifo")
+						p.fifo = std::stoi(value);
+					else if (key == "nice")
+						p.nice = std::stoi(value);
+					else
+						throw std::runtime_error("unknown setting \"" + key + "\" in thread policy");
+				}
+				catch (std::logic_error const &)
+				{
+					throw std::runtime_error("bad value \"" + value + "\" for " + key + " in thread policy");
+				}
+			}
+		}
+	}
+
+	for (auto const &[role, p] : policies)
+	{
+		if (p.fifo && (*p.fifo < sched_get_priority_min(SCHED_FIFO) || *p.fifo > sched_get_priority_max(SCHED_FIFO)))
+			throw std::runtime_error("fifo priority for " + role + " threads is out of range");
+		LOG(1, "Thread policy for " << role << ": " << describe(p));
+	}
+}
+
+void ThreadPolicy::Apply(char const *role, int index)
+{
+	// Thread names can only have 15 characters.
+	char name[16];
+	if (index < 0)
+		snprintf(name, sizeof(name), "%s", role);
+	else
+		snprintf(name, sizeof(name), "%s%d", role, index);
+	pthread_setname_np(pthread_self(), name);
+
+	auto it = policies.find(role);
+	if (it == policies.end())
+		it = policies.find("*");
+	if (it == policies.end())
+		return;
+	Policy const &policy = it->second;
+
+	if (!policy.cpus.empty())
+	{
+		cpu_set_t cpu_set;
+		CPU_ZERO(&cpu_set);
+		for (unsigned int cpu : policy.cpus)
+			CPU_SET(cpu, &cpu_set);
+		if (int ret = pthread_setaffinity_np(pthread_self(), sizeof(cpu_set), &cpu_set))
+		{
+			errno = ret;
+			warn("set CPU affinity", name);
+		}
+	}
+
+	if (policy.fifo)
+	{
+		sched_param param {};
+		param.sched_priority = *policy.fifo;
+		if (int ret = pthread_setschedparam(pthread_self(), SCHED_FIFO, &param))
+		{
+			errno = ret;
+			warn("set SCHED_FIFO", name);
+		}
+	}
+
+	// Nice values belong to each thread on Linux, despite what POSIX says.
+	if (policy.nice && setpriority(PRIO_PROCESS, syscall(SYS_gettid), *policy.nice))
+		warn("set nice value", name);
+
+	LOG(2, "Thread " << name << " (" << syscall(SYS_gettid) << "): " << describe(policy));
+}
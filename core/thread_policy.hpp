@@ -0,0 +1,36 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * thread_policy.hpp - Per-role thread naming, CPU affinity and scheduling.
+ */
+
+#pragma once
+
+#include <string>
+
+// Every thread that we create calls ThreadPolicy::Apply() with its role when it starts. That names the thread
+// (so it shows up in top, perf and the frame trace), and applies whatever CPU affinity and scheduling the user
+// has asked for that role. The roles are:
+//
+//   preview, pp-output, pp-worker, inference, encode, encode-output, encode-poll, audio, replay, display,
+//   watchdog, broker, lease
+//
+// and "*" gives the settings for any role not listed. A policy is a comma separated list of role settings:
+//
+//   preview:cpus=3:fifo=10,encode:cpus=1-2:nice=-5
+//
+// where cpus is a list of CPUs or ranges separated by "+", fifo is a SCHED_FIFO priority and nice a nice value.
+// Alternatively it can be the name of a JSON file such as
+//
+//   { "preview": { "cpus": "3", "fifo": 10 }, "encode": { "cpus": "1-2", "nice": -5 } }
+
+class ThreadPolicy
+{
+public:
+	// Throws if the policy can't be parsed.
+	static void Configure(std::string const &policy);
+
+	// Set up the calling thread for the given role. An index, if given, is added to the thread's name.
+	static void Apply(char const *role, int index = -1);
+};
@@ -0,0 +1,132 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * watchdog.cpp - Spot frames that are late at any point in the pipeline.
+ */
+
+#include <algorithm>
+
+#include "core/frame_trace.hpp"
+#include "core/logging.hpp"
+#include "core/thread_policy.hpp"
+#include "core/watchdog.hpp"
+
+std::atomic<bool> Watchdog::running_ { false };
+std::atomic<bool> Watchdog::shedding_ { false };
+std::atomic<uint64_t> Watchdog::interval_ns_ { 0 };
+Watchdog::HopState Watchdog::hops_[Watchdog::NUM_HOPS];
+unsigned int Watchdog::frames_ = 0;
+bool Watchdog::shed_ = false;
+Watchdog::StallCallback Watchdog::callback_;
+std::thread Watchdog::thread_;
+std::mutex Watchdog::mutex_;
+std::condition_variable Watchdog::cv_;
+bool Watchdog::quit_ = false;
+
+char const *Watchdog::Name(Hop hop)
+{
+	static char const *names[] = { "camera", "post-processing", "encoder", "output" };
+	return names[hop];
+}
+
+void Watchdog::Start(unsigned int frames, bool shed, uint64_t interval_ns, StallCallback callback)
+{
+	Stop();
+	if (!frames)
+		return;
+
+	for (HopState &h : hops_)
+	{
+		h.in = h.out = h.progress_ns = 0;
+		h.stalled = false;
+	}
+	frames_ = frames;
+	shed_ = shed;
+	interval_ns_ = interval_ns;
+	callback_ = std::move(callback);
+	quit_ = false;
+	running_ = true;
+	thread_ = std::thread(&Watchdog::watchdogThread);
+}
+
+void Watchdog::Stop()
+{
+	if (!thread_.joinable())
+		return;
+
+	{
+		std::lock_guard<std::mutex> lock(mutex_);
+		quit_ = true;
+	}
+	cv_.notify_one();
+	thread_.join();
+	running_ = false;
+	shedding_ = false;
+}
+
+void Watchdog::enter(Hop hop)
+{
+	HopState &h = hops_[hop];
+	// A hop that was empty has only just been given something to do.
+	if (h.in.fetch_add(1, std::memory_order_relaxed) == h.out.load(std::memory_order_relaxed))
+		h.progress_ns.store(FrameTrace::Now(), std::memory_order_relaxed);
+}
+
+void Watchdog::leave(Hop hop)
+{
+	HopState &h = hops_[hop];
+	h.progress_ns.store(FrameTrace::Now(), std::memory_order_relaxed);
+	h.out.fetch_add(1, std::memory_order_relaxed);
+}
+
+void Watchdog::watchdogThread()
+{
+	ThreadPolicy::Apply("watchdog");
+
+	std::unique_lock<std::mutex> lock(mutex_);
+	while (true)
+	{
+		// The interval can start out huge (e.g. the longest possible exposure for stills) and shrink once frames
+		// arrive, so don't sleep for too long on the strength of it.
+		uint64_t interval_ns = interval_ns_.load(std::memory_order_relaxed);
+		interval_ns = interval_ns ? interval_ns : DEFAULT_INTERVAL_NS;
+		if (cv_.wait_for(lock, std::chrono::nanoseconds(std::min(interval_ns, MAX_POLL_NS)), [] { return quit_; }))
+			break;
+
+		interval_ns = interval_ns_.load(std::memory_order_relaxed);
+		interval_ns = interval_ns ? interval_ns : DEFAULT_INTERVAL_NS;
+
+		uint64_t now = FrameTrace::Now();
+		bool late = false;
+		for (unsigned int i = 0; i < NUM_HOPS; i++)
+		{
+			HopState &h = hops_[i];
+			uint64_t out = h.out.load(std::memory_order_relaxed);
+			uint64_t progress_ns = h.progress_ns.load(std::memory_order_relaxed);
+			uint64_t deadline_ns = progress_ns + frames_ * interval_ns;
+			bool stalled = out && h.in.load(std::memory_order_relaxed) > out && now > deadline_ns;
+			late |= stalled && i != Camera;
+
+			if (stalled == h.stalled)
+				continue;
+			h.stalled = stalled;
+
+			Stall stall { static_cast<Hop>(i), now - progress_ns, !stalled };
+			if (stalled)
+				LOG(1, "WARNING: " << Name(stall.hop) << " has not finished a frame for " << stall.late_ns / 1000000
+								   << "ms");
+			else
+				LOG(1, Name(stall.hop) << " is moving again");
+			lock.unlock();
+			callback_(stall);
+			lock.lock();
+		}
+
+		if (shed_ && late != shedding_.exchange(late, std::memory_order_relaxed))
+		{
+			char const *msg = late ? "Shedding optional work until the pipeline catches up" : "No longer shedding work";
+			LOG(1, msg);
+		}
+	}
+}
@@ -0,0 +1,91 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2025, Raspberry Pi Ltd
+ *
+ * watchdog.hpp - Spot frames that are late at any point in the pipeline.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <condition_variable>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+
+// Each hop of the pipeline counts frames in and out, and the watchdog thread checks once per frame interval
+// that any hop with frames inside has let one out within the last few intervals. If the camera is late the
+// sensor or ISP is in trouble, and if anything else is late the pipeline is backing up and the camera will
+// soon run out of requests. Hops aren't checked until they've passed their first frame, which can take much
+// longer while everything gets going.
+
+class Watchdog
+{
+public:
+	enum Hop
+	{
+		Camera,
+		Stages,
+		Encoder,
+		Output,
+		NUM_HOPS
+	};
+
+	struct Stall
+	{
+		Hop hop;
+		uint64_t late_ns; // how long the hop has gone without finishing a frame
+		bool recovered; // the hop is moving again
+	};
+	using StallCallback = std::function<void(Stall const &)>;
+
+	static char const *Name(Hop hop);
+
+	// Frames count as late after frames intervals. With shed set, optional work gets skipped while any hop
+	// other than the camera is late.
+	static void Start(unsigned int frames, bool shed, uint64_t interval_ns, StallCallback callback);
+	static void Stop();
+	static void SetInterval(uint64_t interval_ns) { interval_ns_.store(interval_ns, std::memory_order_relaxed); }
+
+	static void Enter(Hop hop)
+	{
+		if (running_.load(std::memory_order_relaxed))
+			enter(hop);
+	}
+	static void Leave(Hop hop)
+	{
+		if (running_.load(std::memory_order_relaxed))
+			leave(hop);
+	}
+	static bool Shedding() { return shedding_.load(std::memory_order_relaxed); }
+
+private:
+	struct HopState
+	{
+		std::atomic<uint64_t> in { 0 };
+		std::atomic<uint64_t> out { 0 };
+		std::atomic<uint64_t> progress_ns { 0 }; // when a frame last came out, or went into an empty hop
+		bool stalled = false; // only used by the watchdog thread
+	};
+
+	static constexpr uint64_t DEFAULT_INTERVAL_NS = 33333333;
+	// The watchdog looks at least this often, whatever the interval.
+	static constexpr uint64_t MAX_POLL_NS = 100000000;
+
+	static void enter(Hop hop);
+	static void leave(Hop hop);
+	static void watchdogThread();
+
+	static std::atomic<bool> running_;
+	static std::atomic<bool> shedding_;
+	static std::atomic<uint64_t> interval_ns_;
+	static HopState hops_[NUM_HOPS];
+	static unsigned int frames_;
+	static bool shed_;
+	static StallCallback callback_;
+	static std::thread thread_;
+	static std::mutex mutex_;
+	static std::condition_variable cv_;
+	static bool quit_;
+};
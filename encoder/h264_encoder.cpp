@@ -15,6 +15,8 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/thread_policy.hpp"
+
 #include "h264_encoder.hpp"
 
 static int xioctl(int fd, unsigned long ctl, void *arg)
@@ -274,6 +276,8 @@ void H264Encoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 
 void H264Encoder::pollThread()
 {
+	ThreadPolicy::Apply("encode-poll");
+
 	while (true)
 	{
 		pollfd p = { fd_, POLLIN, 0 };
@@ -338,6 +342,8 @@ void H264Encoder::pollThread()
 
 void H264Encoder::outputThread()
 {
+	ThreadPolicy::Apply("encode-output");
+
 	OutputItem item;
 	while (true)
 	{
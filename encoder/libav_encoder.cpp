@@ -17,6 +17,8 @@
 #include <chrono>
 #include <iostream>
 
+#include "core/thread_policy.hpp"
+
 #include "libav_encoder.hpp"
 
 namespace {
@@ -594,6 +596,8 @@ extern "C" void LibAvEncoder::releaseBuffer(void *opaque, uint8_t *data)
 
 void LibAvEncoder::videoThread()
 {
+	ThreadPolicy::Apply("encode");
+
 	AVPacket *pkt = av_packet_alloc();
 	AVFrame *frame = nullptr;
 
@@ -639,6 +643,8 @@ done:
 
 void LibAvEncoder::audioThread()
 {
+	ThreadPolicy::Apply("audio");
+
 	const AVSampleFormat required_fmt = codec_ctx_[AudioOut]->sample_fmt;
 	// Amount of time to pre-record audio into the fifo before the first video frame.
 	constexpr std::chrono::milliseconds pre_record_time(10);
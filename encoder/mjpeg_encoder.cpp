@@ -10,6 +10,8 @@
 
 #include <jpeglib.h>
 
+#include "core/thread_policy.hpp"
+
 #include "mjpeg_encoder.hpp"
 
 #if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
@@ -93,6 +95,8 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 
 void MjpegEncoder::encodeThread(int num)
 {
+	ThreadPolicy::Apply("encode", num);
+
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
@@ -149,6 +153,8 @@ void MjpegEncoder::encodeThread(int num)
 
 void MjpegEncoder::outputThread()
 {
+	ThreadPolicy::Apply("encode-output");
+
 	OutputItem item;
 	uint64_t index = 0;
 	while (true)
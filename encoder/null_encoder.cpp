@@ -9,6 +9,8 @@
 #include <iostream>
 #include <stdexcept>
 
+#include "core/thread_policy.hpp"
+
 #include "null_encoder.hpp"
 
 NullEncoder::NullEncoder(VideoOptions const *options) : Encoder(options), abort_(false)
@@ -37,6 +39,8 @@ void NullEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const
 // of buffers limits the amount of queueing possible here...
 void NullEncoder::outputThread()
 {
+	ThreadPolicy::Apply("encode-output");
+
 	OutputItem item;
 	while (true)
 	{
@@ -13,6 +13,7 @@
 
 #include <tiffio.h>
 
+#include "core/scratch_pool.hpp"
 #include "core/still_options.hpp"
 #include "core/stream_info.hpp"
 
@@ -310,7 +311,8 @@ void dng_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const
 	// Decompression will require a buffer that's 8 pixels aligned.
 	unsigned int buf_stride_pixels = info.width;
 	unsigned int buf_stride_pixels_padded = (buf_stride_pixels + 7) & ~7;
-	std::vector<uint16_t> buf(buf_stride_pixels_padded * info.height);
+	std::shared_ptr<uint16_t> buf_ptr = ScratchPool::Get().Allocate<uint16_t>(buf_stride_pixels_padded * info.height);
+	uint16_t *buf = buf_ptr.get();
 	if (bayer_format.compressed)
 	{
 		uncompress(mem[0].data(), info, &buf[0]);
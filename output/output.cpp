@@ -8,6 +8,9 @@
 #include <cinttypes>
 #include <stdexcept>
 
+#include "core/frame_trace.hpp"
+#include "core/watchdog.hpp"
+
 #include "circular_output.hpp"
 #include "file_output.hpp"
 #include "net_output.hpp"
@@ -70,7 +73,10 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 		time_offset_ = timestamp_us - last_timestamp_;
 	last_timestamp_ = timestamp_us - time_offset_;
 
+	Watchdog::Enter(Watchdog::Output);
 	outputBuffer(mem, size, last_timestamp_, flags);
+	Watchdog::Leave(Watchdog::Output);
+	FrameTrace::Record(FrameTrace::OutputWrite, 0, timestamp_us);
 
 	// Save timestamps to a file, if that was requested.
 	if (fp_timestamps_)
@@ -80,7 +86,7 @@ void Output::OutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyf
 
 	if (!options_->Get().metadata.empty())
 	{
-		libcamera::ControlList metadata = metadata_queue_.front();
+		libcamera::ControlList &metadata = metadata_queue_.front();
 		write_metadata(buf_metadata_, options_->Get().metadata_format, metadata, !metadata_started_);
 		metadata_started_ = true;
 		metadata_queue_.pop();
@@ -7,6 +7,7 @@
 
 #include <algorithm>
 #include <chrono>
+#include <future>
 #include <iostream>
 #include <iterator>
 #include <libcamera/stream.h>
@@ -16,6 +17,7 @@
 #include <libcamera/geometry.h>
 
 #include "core/rpicam_app.hpp"
+#include "core/thread_policy.hpp"
 
 #include "post_processing_stages/post_processing_stage.hpp"
 
@@ -127,7 +129,10 @@ bool FaceDetectCvStage::Process(CompletedRequestPtr &completed_request)
 			image_ = image.clone();
 
 			future_ptr_ = std::make_unique<std::future<void>>();
-			*future_ptr_ = std::async(std::launch::async, [this] { detectFeatures(cascade_); });
+			*future_ptr_ = std::async(std::launch::async, [this] {
+				ThreadPolicy::Apply("inference");
+				detectFeatures(cascade_);
+			});
 		}
 	}
 
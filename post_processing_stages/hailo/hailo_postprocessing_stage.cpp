@@ -14,6 +14,8 @@
 #include <opencv2/imgproc.hpp>
 #include <opencv2/opencv.hpp>
 
+#include "core/thread_policy.hpp"
+
 #include "hailo_postprocessing_stage.hpp"
 
 #include "hailo_postproc_lib.h"
@@ -381,6 +383,8 @@ Rectangle HailoPostProcessingStage::ConvertInferenceCoordinates(const std::vecto
 
 void Display::displayThread()
 {
+	ThreadPolicy::Apply("display");
+
 	RgbImagePtr current_image;
 
 	while (true)
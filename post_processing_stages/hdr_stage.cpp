@@ -143,12 +143,10 @@ void HdrImage::Accumulate(uint8_t const *src, int stride)
 
 // Forward pass of the IIR low pass filter.
 
-static void forward_pass(std::vector<double> &fwd_pixels, std::vector<double> &fwd_weight_sums, HdrImage const &in,
-						 std::vector<double> &weights, std::vector<double> &threshold, int width, int height, int size,
-						 double strength)
+static void forward_pass(double *fwd_pixels, double *fwd_weight_sums, HdrImage const &in, std::vector<double> &weights,
+						 std::vector<double> &threshold, int width, int height, int size, double strength)
 
 {
-	// (Should probably initialise the top/left elements of fwd_pixels/fwd_weight_sums...)
 	for (int y = size; y < height; y++)
 	{
 		unsigned int off = y * width + size;
@@ -200,22 +198,29 @@ HdrImage HdrImage::LpFilter(LpFilterConfig const &config) const
 	int size = 1;
 	double strength = config.strength;
 
-	// Forward pass.
-	std::vector<double> fwd_weight_sums(width * height);
-	std::vector<double> fwd_pixels(width * height);
+	// Forward pass. The filter buffers are big, so re-use them from one capture to the next, but the edges
+	// that the passes don't write still need to be zero.
+	unsigned int num_pixels = width * height;
+	std::shared_ptr<double> fwd_weight_sums_buf = ScratchPool::Get().Allocate<double>(num_pixels);
+	std::shared_ptr<double> fwd_pixels_buf = ScratchPool::Get().Allocate<double>(num_pixels);
+	double *fwd_weight_sums = fwd_weight_sums_buf.get(), *fwd_pixels = fwd_pixels_buf.get();
+	std::fill_n(fwd_weight_sums, num_pixels, 0.0);
+	std::fill_n(fwd_pixels, num_pixels, 0.0);
 
 	HdrImage out(width, height, width * height);
 	out.dynamic_range = dynamic_range;
 
 	// Run the forward pass in other thread, so that the two passes run in parallel.
-	std::thread fwd_pass(forward_pass, std::ref(fwd_pixels), std::ref(fwd_weight_sums), std::ref(*this),
-						 std::ref(weights), std::ref(threshold), width, height, size, strength);
+	std::thread fwd_pass(forward_pass, fwd_pixels, fwd_weight_sums, std::ref(*this), std::ref(weights),
+						 std::ref(threshold), width, height, size, strength);
 
 	// Reverse pass, but otherwise the same as the forward pass. There could be a small
 	// saving in omitting it, but it's not huge given that they run in parallel.
-	std::vector<double> rev_weight_sums(width * height);
-	std::vector<double> rev_pixels(width * height);
-	// (Should probably initialise the bottom/right elements of rev_pixels/rev_weight_sums...)
+	std::shared_ptr<double> rev_weight_sums_buf = ScratchPool::Get().Allocate<double>(num_pixels);
+	std::shared_ptr<double> rev_pixels_buf = ScratchPool::Get().Allocate<double>(num_pixels);
+	double *rev_weight_sums = rev_weight_sums_buf.get(), *rev_pixels = rev_pixels_buf.get();
+	std::fill_n(rev_weight_sums, num_pixels, 0.0);
+	std::fill_n(rev_pixels, num_pixels, 0.0);
 	for (int y = height - 1 - size; y >= 0; y--)
 	{
 		unsigned int off = y * width + width - 1 - size;
@@ -37,6 +37,10 @@ void PostProcessingStage::Stop()
 {
 }
 
+void PostProcessingStage::ReleaseRequests()
+{
+}
+
 void PostProcessingStage::Teardown()
 {
 }
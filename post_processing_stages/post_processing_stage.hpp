@@ -19,6 +19,7 @@
 #include <boost/property_tree/ptree.hpp>
 
 #include "core/completed_request.hpp"
+#include "core/scratch_pool.hpp"
 #include "core/stream_info.hpp"
 
 namespace libcamera
@@ -52,6 +53,11 @@ public:
 
 	virtual void Stop();
 
+	// Called once the camera has stopped and the post-processor's threads have finished, without any of the
+	// camera's locks held. A stage that keeps requests beyond Process() must let go of them here, and not in
+	// Stop(), where giving a request back would try to re-queue it under a lock that is already held.
+	virtual void ReleaseRequests();
+
 	virtual void Teardown();
 
 	// Below here are some helpers provided for the convenience of derived classes.
@@ -74,6 +80,13 @@ protected:
 		return std::chrono::duration<double, R>(t2 - t1);
 	}
 
+	// Large per-frame buffers should come from here, so that the memory gets re-used. The contents are undefined.
+	template <typename T>
+	static std::shared_ptr<T> GetScratch(std::size_t count)
+	{
+		return ScratchPool::Get().Allocate<T>(count);
+	}
+
 	template <typename T>
 	static std::vector<T> GetJsonArray(const boost::property_tree::ptree &pt, const std::string &key,
 									   const std::vector<T> &default_value = {})
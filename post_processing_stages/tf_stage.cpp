@@ -4,6 +4,10 @@
  *
  * tf_stage.hpp - base class for TensorFlowLite stages
  */
+#include <algorithm>
+
+#include "core/thread_policy.hpp"
+
 #include "tf_stage.hpp"
 
 TfStage::TfStage(RPiCamApp *app, int tf_w, int tf_h) : PostProcessingStage(app), tf_w_(tf_w), tf_h_(tf_h)
@@ -110,6 +114,7 @@ bool TfStage::Process(CompletedRequestPtr &completed_request)
 
 			future_ = std::make_unique<std::future<void>>();
 			*future_ = std::async(std::launch::async, [this] {
+				ThreadPolicy::Apply("inference");
 				auto time_taken = ExecutionTime<std::micro>(&TfStage::runInference, this).count();
 
 				if (config_->verbose)
@@ -129,19 +134,20 @@ void TfStage::runInference()
 	int input = interpreter_->inputs()[0];
 	StreamInfo tf_info;
 	tf_info.width = tf_w_, tf_info.height = tf_h_, tf_info.stride = tf_w_ * 3;
-	std::vector<uint8_t> rgb_image = Yuv420ToRgb(lores_copy_.data(), lores_info_, tf_info);
+	unsigned int rgb_size = tf_info.height * tf_info.stride;
+	std::shared_ptr<uint8_t> rgb_image = GetScratch<uint8_t>(rgb_size);
+	Yuv420ToRgb(rgb_image.get(), lores_copy_.data(), lores_info_, tf_info);
 
 	if (interpreter_->tensor(input)->type == kTfLiteUInt8)
 	{
 		uint8_t *tensor = interpreter_->typed_tensor<uint8_t>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = rgb_image[i];
+		std::copy_n(rgb_image.get(), rgb_size, tensor);
 	}
 	else if (interpreter_->tensor(input)->type == kTfLiteFloat32)
 	{
 		float *tensor = interpreter_->typed_tensor<float>(input);
-		for (unsigned int i = 0; i < rgb_image.size(); i++)
-			tensor[i] = (rgb_image[i] - config_->normalisation_offset) / config_->normalisation_scale;
+		for (unsigned int i = 0; i < rgb_size; i++)
+			tensor[i] = (rgb_image.get()[i] - config_->normalisation_offset) / config_->normalisation_scale;
 	}
 
 	if (interpreter_->Invoke() != kTfLiteOk)
@@ -13,6 +13,7 @@
 
 // This header must be before the QT headers, as the latter #defines slot and emit!
 #include "core/options.hpp"
+#include "core/thread_policy.hpp"
 
 #include <QApplication>
 #include <QImage>
@@ -192,6 +193,8 @@ public:
 private:
 	void threadFunc(Options const *options)
 	{
+		ThreadPolicy::Apply("preview");
+
 		// This acts as Qt's event loop. Really Qt prefers to own the application's event loop
 		// but we've supplied our own and only want Qt for rendering. This works, but I
 		// wouldn't write a proper Qt application like this.